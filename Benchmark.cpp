@@ -0,0 +1,177 @@
+/*
+
+Copyright © 2023 Matthew Moore
+
+This engine is free software. You can redistribute it and/or modify it under the terms of the License below.
+The Nova SDL Game Library is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+
+This engine is licensed under a Creative Commons Attribution-ShareAlike 4.0 International License.
+https://creativecommons.org/licenses/by-sa/4.0/
+
+ You are free to:
+
+    Share — copy and redistribute the material in any medium or format for any purpose, even commercially.
+    Adapt — remix, transform, and build upon the material for any purpose, even commercially. 
+
+ Under the following terms:
+
+    Attribution - You must give appropriate credit, provide a link to the license, and indicate if changes were made. You may do so in any reasonable manner, but not in any way that suggests the licensor endorses you or your use.
+    ShareAlike - If you remix, transform, or build upon the material, you must distribute your contributions under the same license as the original. 
+
+*/
+#include "Benchmark.hpp"
+#include <sstream>
+#include <random>
+
+CameraKeyframe Benchmark::sample(int frame, int frames) const
+{
+    if (path.empty()) return {game->getPlayerPos(), game->getAngle()};
+    if (path.size() == 1 || frames < 2) return path.front();
+    double t = static_cast<double>(frame) / (frames - 1) * (path.size() - 1);
+    int segment = std::min(static_cast<int>(t), static_cast<int>(path.size()) - 2);
+    double f = t - segment;
+    const CameraKeyframe& a = path[segment];
+    const CameraKeyframe& b = path[segment + 1];
+    double turn = fmod(b.angle - a.angle + 540.0, 360.0) - 180.0; //shortest way round
+    return {{a.pos.x + (b.pos.x - a.pos.x) * f, a.pos.y + (b.pos.y - a.pos.y) * f}, a.angle + turn * f};
+}
+
+BenchmarkResult Benchmark::run(int frames, int FOV)
+{
+    BenchmarkResult result;
+    if (frames <= 0) return result;
+    std::vector<double> frameMs;
+    frameMs.reserve(frames);
+    const double freq = static_cast<double>(SDL_GetPerformanceFrequency());
+    for (int i = 0; i < frames; i++)
+    {
+        CameraKeyframe cam = sample(i, frames);
+        game->teleportPlayer(cam.pos);
+        game->setAngle(cam.angle);
+        Uint64 start = SDL_GetPerformanceCounter();
+        game->pseudo3dRenderTextured(FOV);
+        frameMs.push_back((SDL_GetPerformanceCounter() - start) * 1000.0 / freq);
+        const RenderStats& stats = game->getRenderStats();
+        for (int s = 0; s < STAGE_COUNT; s++) result.stageMs[s] += stats.stageMs[s] / frames;
+        result.ddaSteps += static_cast<double>(stats.ddaSteps) / frames;
+        result.pixelsWritten += static_cast<double>(stats.pixelsWritten) / frames;
+    }
+    double total = 0;
+    for (double ms : frameMs) total += ms;
+    std::sort(frameMs.begin(), frameMs.end());
+    //nearest rank percentile
+    auto percentile = [&](double p) { return frameMs[std::min(frames - 1, static_cast<int>(ceil(p / 100.0 * frames)) - 1)]; };
+    result.frames = frames;
+    result.width = game->getRenderWidth();
+    result.height = game->getRenderHeight();
+    result.FOV = FOV;
+    result.meanMs = total / frames;
+    result.p50Ms = percentile(50);
+    result.p95Ms = percentile(95);
+    result.p99Ms = percentile(99);
+    result.minMs = frameMs.front();
+    result.maxMs = frameMs.back();
+    if (total > 0) result.mpixelsPerSec = static_cast<double>(result.width) * result.height * frames / (total / 1000.0) / 1e6;
+    return result;
+}
+
+std::string BenchmarkResult::toJSON() const
+{
+    std::ostringstream out;
+    out << "{\n"
+        << "  \"frames\": " << frames << ",\n"
+        << "  \"width\": " << width << ",\n"
+        << "  \"height\": " << height << ",\n"
+        << "  \"fov\": " << FOV << ",\n"
+        << "  \"mean_ms\": " << meanMs << ",\n"
+        << "  \"p50_ms\": " << p50Ms << ",\n"
+        << "  \"p95_ms\": " << p95Ms << ",\n"
+        << "  \"p99_ms\": " << p99Ms << ",\n"
+        << "  \"min_ms\": " << minMs << ",\n"
+        << "  \"max_ms\": " << maxMs << ",\n"
+        << "  \"mpixels_per_sec\": " << mpixelsPerSec << ",\n"
+        << "  \"dda_steps\": " << ddaSteps << ",\n"
+        << "  \"pixels_written\": " << pixelsWritten << ",\n"
+        << "  \"stages_ms\": {";
+    for (int s = 0; s < STAGE_COUNT; s++)
+        out << (s ? ", " : "") << "\"" << RenderStats::stageName(s) << "\": " << stageMs[s];
+    out << "}\n"
+        << "}";
+    return out.str();
+}
+
+PathBenchmarkResult PathBenchmark::run(int queries, unsigned seed)
+{
+    PathBenchmarkResult result;
+    result.queries = queries;
+    Pathfinder pf;
+    pf.setMap(map);
+    std::mt19937 rng(seed);
+    std::uniform_int_distribution<int> xs(0, map->xSize() - 1), ys(0, map->ySize() - 1);
+    auto openCell = [&]() {
+        Node n = {};
+        for (int tries = 0; tries < 1000; tries++)
+        {
+            n.pos = { static_cast<double>(xs(rng)), static_cast<double>(ys(rng)) };
+            if (pf.isValid(n.pos.x, n.pos.y)) break;
+        }
+        return n;
+    };
+    const double freq = static_cast<double>(SDL_GetPerformanceFrequency());
+    for (int i = 0; i < queries; i++)
+    {
+        const Node start = openCell(), goal = openCell();
+        Uint64 t0 = SDL_GetPerformanceCounter();
+        const size_t aStarCells = pf.aStar(start, goal).size();
+        const Uint64 aStarExpansions = pf.getExpansions();
+        Uint64 t1 = SDL_GetPerformanceCounter();
+        const size_t jpsCells = pf.jps(start, goal).size();
+        const Uint64 jpsExpansions = pf.getExpansions();
+        Uint64 t2 = SDL_GetPerformanceCounter();
+        if (!aStarCells || !jpsCells) continue;
+        result.found++;
+        result.aStarMs += (t1 - t0) * 1000.0 / freq;
+        result.jpsMs += (t2 - t1) * 1000.0 / freq;
+        result.aStarExpansions += aStarExpansions;
+        result.jpsExpansions += jpsExpansions;
+        result.aStarCells += aStarCells;
+        result.jpsCells += jpsCells;
+    }
+    if (result.found)
+    {
+        result.aStarMs /= result.found;
+        result.jpsMs /= result.found;
+        result.aStarExpansions /= result.found;
+        result.jpsExpansions /= result.found;
+        result.aStarCells /= result.found;
+        result.jpsCells /= result.found;
+    }
+    return result;
+}
+
+std::vector<std::vector<int>> PathBenchmark::openMap(int size, unsigned seed)
+{
+    std::vector<std::vector<int>> walls(size, std::vector<int>(size, 0));
+    std::mt19937 rng(seed);
+    for (int y = 0; y < size; y++)
+        for (int x = 0; x < size; x++)
+            if (x == 0 || y == 0 || x == size - 1 || y == size - 1 || rng() % 100 == 0) walls[y][x] = 1;
+    return walls;
+}
+
+std::string PathBenchmarkResult::toJSON() const
+{
+    std::ostringstream out;
+    out << "{\n"
+        << "  \"queries\": " << queries << ",\n"
+        << "  \"found\": " << found << ",\n"
+        << "  \"astar_ms\": " << aStarMs << ",\n"
+        << "  \"jps_ms\": " << jpsMs << ",\n"
+        << "  \"astar_expansions\": " << aStarExpansions << ",\n"
+        << "  \"jps_expansions\": " << jpsExpansions << ",\n"
+        << "  \"astar_cells\": " << aStarCells << ",\n"
+        << "  \"jps_cells\": " << jpsCells << "\n"
+        << "}";
+    return out.str();
+}
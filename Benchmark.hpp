@@ -0,0 +1,100 @@
+/*
+
+Copyright © 2023 Matthew Moore
+
+This engine is free software. You can redistribute it and/or modify it under the terms of the License below.
+The Nova SDL Game Library is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+
+This engine is licensed under a Creative Commons Attribution-ShareAlike 4.0 International License.
+https://creativecommons.org/licenses/by-sa/4.0/
+
+ You are free to:
+
+    Share — copy and redistribute the material in any medium or format for any purpose, even commercially.
+    Adapt — remix, transform, and build upon the material for any purpose, even commercially. 
+
+ Under the following terms:
+
+    Attribution - You must give appropriate credit, provide a link to the license, and indicate if changes were made. You may do so in any reasonable manner, but not in any way that suggests the licensor endorses you or your use.
+    ShareAlike - If you remix, transform, or build upon the material, you must distribute your contributions under the same license as the original. 
+
+*/
+#ifndef BENCHMARK_HPP
+#define BENCHMARK_HPP
+#include "engine.hpp"
+#include "Pathfinding.hpp"
+#include <string>
+
+//A point on the scripted camera path, angle in degrees same as GridGame::setAngle
+struct CameraKeyframe
+{
+    Point pos;
+    double angle;
+};
+
+//Frame time statistics in milliseconds
+struct BenchmarkResult
+{
+    int frames = 0;
+    int width = 0;
+    int height = 0;
+    int FOV = 0;
+    double meanMs = 0;
+    double p50Ms = 0;
+    double p95Ms = 0;
+    double p99Ms = 0;
+    double minMs = 0;
+    double maxMs = 0;
+    double mpixelsPerSec = 0;
+    //per frame averages of GridGame::getRenderStats
+    double stageMs[STAGE_COUNT] = {};
+    double ddaSteps = 0;
+    double pixelsWritten = 0;
+    std::string toJSON() const;
+};
+
+//Flies the camera along a path of keyframes and times every frame of pseudo3dRenderTextured.
+//The camera is placed by frame index rather than wall clock time so two runs render the exact same frames
+class Benchmark
+{
+public:
+    Benchmark(GridGame* g) : game(g) {}
+    void setPath(std::vector<CameraKeyframe> p) { path = p; };
+    const std::vector<CameraKeyframe>& getPath() const { return path; };
+    //Renders the given number of frames and returns the stats. Leaves the camera at the end of the path
+    BenchmarkResult run(int frames, int FOV);
+    //Camera position for a frame, linear between keyframes and the shortest way round for the angle
+    CameraKeyframe sample(int frame, int frames) const;
+private:
+    GridGame* game = nullptr;
+    std::vector<CameraKeyframe> path;
+};
+
+//Per query averages for aStar against jps over the same start and goal pairs
+struct PathBenchmarkResult
+{
+    int queries = 0;
+    int found = 0; //pairs both searches found a path for, the averages are over these
+    double aStarMs = 0;
+    double jpsMs = 0;
+    double aStarExpansions = 0;
+    double jpsExpansions = 0;
+    double aStarCells = 0; //path length in cells
+    double jpsCells = 0;
+    std::string toJSON() const;
+};
+
+//Times both searches between random open cells of a map. The pairs come from the seed so runs are comparable
+class PathBenchmark
+{
+public:
+    PathBenchmark(Map* m) : map(m) {}
+    PathBenchmarkResult run(int queries, unsigned seed = 1);
+    //square map of the given size, open apart from the border and scattered single cell pillars
+    static std::vector<std::vector<int>> openMap(int size, unsigned seed = 1);
+private:
+    Map* map = nullptr;
+};
+
+#endif
@@ -0,0 +1,334 @@
+/*
+
+Copyright © 2023 Matthew Moore
+
+This engine is free software. You can redistribute it and/or modify it under the terms of the License below.
+The Nova SDL Game Library is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+
+This engine is licensed under a Creative Commons Attribution-ShareAlike 4.0 International License.
+https://creativecommons.org/licenses/by-sa/4.0/
+
+ You are free to:
+
+    Share — copy and redistribute the material in any medium or format for any purpose, even commercially.
+    Adapt — remix, transform, and build upon the material for any purpose, even commercially. 
+
+ Under the following terms:
+
+    Attribution - You must give appropriate credit, provide a link to the license, and indicate if changes were made. You may do so in any reasonable manner, but not in any way that suggests the licensor endorses you or your use.
+    ShareAlike - If you remix, transform, or build upon the material, you must distribute your contributions under the same license as the original. 
+
+*/
+#include "LevelFile.hpp"
+#include <cstring>
+#include <cstdio>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+static_assert(sizeof(Cell) == 16, "level files store cells byte for byte");
+
+bool MappedFile::open(const std::string& path)
+{
+    close();
+#ifdef _WIN32
+    HANDLE f = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (f == INVALID_HANDLE_VALUE) return false;
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(f, &fileSize) || fileSize.QuadPart == 0)
+    {
+        CloseHandle(f);
+        return false;
+    }
+    HANDLE m = CreateFileMappingA(f, nullptr, PAGE_WRITECOPY, 0, 0, nullptr);
+    void* view = m ? MapViewOfFile(m, FILE_MAP_COPY, 0, 0, 0) : nullptr;
+    if (!view)
+    {
+        if (m) CloseHandle(m);
+        CloseHandle(f);
+        return false;
+    }
+    file = f;
+    mapping = m;
+    base = static_cast<Uint8*>(view);
+    length = static_cast<size_t>(fileSize.QuadPart);
+#else
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0)
+    {
+        ::close(fd);
+        return false;
+    }
+    void* view = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    ::close(fd); //the mapping keeps its own reference to the file
+    if (view == MAP_FAILED) return false;
+    base = static_cast<Uint8*>(view);
+    length = st.st_size;
+#endif
+    return true;
+}
+
+void MappedFile::close()
+{
+    if (!base) return;
+#ifdef _WIN32
+    UnmapViewOfFile(base);
+    CloseHandle(static_cast<HANDLE>(mapping));
+    CloseHandle(static_cast<HANDLE>(file));
+    file = mapping = nullptr;
+#else
+    munmap(base, length);
+#endif
+    base = nullptr;
+    length = 0;
+}
+
+bool LevelFile::open(const std::string& path, int textureCount)
+{
+    mapped.reset(new MappedFile());
+    if (!mapped->open(path))
+    {
+        std::cerr << "Couldn't map level " << path << "\n";
+        mapped.reset();
+        return false;
+    }
+    //everything later reads straight out of the mapping so check every section fits before trusting it
+    const LevelHeader expected;
+    const size_t size = mapped->size();
+    bool valid = size >= sizeof(LevelHeader);
+    const LevelHeader& h = *reinterpret_cast<const LevelHeader*>(mapped->data());
+    valid = valid && memcmp(h.magic, expected.magic, 4) == 0 && h.version == LEVEL_VERSION && h.headerSize == sizeof(LevelHeader) &&
+            h.chunkShift == nva::CHUNK_SHIFT && h.cellSize == sizeof(Cell) && h.width > 0 && h.height > 0 && h.cellOffset % alignof(Cell) == 0;
+    auto fits = [&](Uint64 offset, Uint64 count, Uint64 bytes) { return offset <= size && count <= (size - offset) / bytes; };
+    if (valid)
+    {
+        const Uint64 chunksX = (h.width + nva::CHUNK_SIZE - 1) >> nva::CHUNK_SHIFT;
+        const Uint64 chunksY = (h.height + nva::CHUNK_SIZE - 1) >> nva::CHUNK_SHIFT;
+        valid = h.chunkCount == chunksX * chunksY && fits(h.cellOffset, h.chunkCount * nva::CHUNK_CELLS, sizeof(Cell)) &&
+                fits(h.doorOffset, h.doorCount, sizeof(DoorRecord)) && fits(h.spriteOffset, h.spriteCount, sizeof(SpriteRecord)) &&
+                fits(h.poolOffset, h.poolCount, sizeof(Sint32)) && fits(h.spawnOffset, h.spawnCount, sizeof(SpawnRecord));
+    }
+    //wall and door textures count from 1 with 0 meaning none, floors and ceilings count from 0
+    if (valid)
+    {
+        const Cell* cells = reinterpret_cast<const Cell*>(mapped->data() + h.cellOffset);
+        for (Uint64 i = 0; valid && i < h.chunkCount * nva::CHUNK_CELLS; i++)
+        {
+            const Cell& c = cells[i];
+            const bool doorOK = (c.door == -1 && !(c.flags & CELL_DOOR)) || (c.door >= 0 && static_cast<Uint64>(c.door) < h.doorCount);
+            valid = doorOK && c.wall <= textureCount && c.floor < textureCount && ((c.flags & CELL_SKY) || c.ceiling < textureCount);
+        }
+        const DoorRecord* records = section<DoorRecord>(h.doorOffset);
+        for (Uint64 i = 0; valid && i < h.doorCount; i++) valid = records[i].texIndex <= textureCount;
+    }
+    if (!valid)
+    {
+        std::cerr << "Level " << path << " isn't a version " << LEVEL_VERSION << " level, is truncated or points outside its doors or textures\n";
+        mapped.reset();
+        return false;
+    }
+    return true;
+}
+
+Cell* LevelFile::chunkCells(int chunk) const
+{
+    return reinterpret_cast<Cell*>(mapped->data() + header().cellOffset) + static_cast<size_t>(chunk) * nva::CHUNK_CELLS;
+}
+
+std::vector<Door> LevelFile::doors() const
+{
+    std::vector<Door> out;
+    const DoorRecord* records = section<DoorRecord>(header().doorOffset);
+    for (Uint64 i = 0; i < header().doorCount; i++)
+    {
+        const DoorRecord& r = records[i];
+        Door d;
+        d.exists = r.exists;
+        d.texIndex = r.texIndex;
+        d.doorState = r.doorState;
+        d.doorProgress = r.doorProgress;
+        d.orientation = r.orientation;
+        d.ID = r.ID;
+        d.doorTime = r.doorTime;
+        d.state = static_cast<DoorState>(r.state);
+        d.x = r.x;
+        d.y = r.y;
+        out.push_back(d);
+    }
+    return out;
+}
+
+std::vector<Sprite> LevelFile::sprites() const
+{
+    std::vector<Sprite> out;
+    const SpriteRecord* records = section<SpriteRecord>(header().spriteOffset);
+    const Sint32* pool = section<Sint32>(header().poolOffset);
+    const Uint64 poolCount = header().poolCount;
+    //ranges are clamped to the pool so a bad record can't read past the mapping
+    auto list = [&](Uint32 first, Uint32 count) {
+        if (first > poolCount) return std::vector<int>();
+        return std::vector<int>(pool + first, pool + first + std::min<Uint64>(count, poolCount - first));
+    };
+    for (Uint64 i = 0; i < header().spriteCount; i++)
+    {
+        const SpriteRecord& r = records[i];
+        Sprite s;
+        s.x = r.x;
+        s.y = r.y;
+        s.texIndex = r.texIndex;
+        s.angle = r.angle;
+        s.animated = r.animated;
+        s.multiAngle = r.multiAngle;
+        s.animIndexes = list(r.animFirst, r.animCount);
+        s.angleIndexes = list(r.angleFirst, r.angleCount);
+        std::vector<int> reels = list(r.reelFirst, 2 * r.reelCount);
+        for (size_t k = 0; k + 1 < reels.size(); k += 2) s.animIndexesAngled.push_back(list(reels[k], reels[k + 1]));
+        out.push_back(s);
+    }
+    return out;
+}
+
+std::vector<EntitySpawn> LevelFile::spawns() const
+{
+    std::vector<EntitySpawn> out;
+    const SpawnRecord* records = section<SpawnRecord>(header().spawnOffset);
+    for (Uint64 i = 0; i < header().spawnCount; i++)
+    {
+        const SpawnRecord& r = records[i];
+        EntitySpawn spawn;
+        spawn.entity.pos = {r.x, r.y};
+        spawn.entity.radius = r.radius;
+        spawn.entity.HP = r.HP;
+        spawn.entity.nametype = std::string(r.type, strnlen(r.type, sizeof(r.type)));
+        spawn.sprite = (r.sprite >= 0 && static_cast<Uint64>(r.sprite) < header().spriteCount) ? r.sprite : -1;
+        out.push_back(spawn);
+    }
+    return out;
+}
+
+Uint64 alignFile(FILE* out, Uint64 offset)
+{
+    const Uint64 SECTION_ALIGN = 64;
+    static const char zeros[SECTION_ALIGN] = {};
+    Uint64 padding = (SECTION_ALIGN - offset % SECTION_ALIGN) % SECTION_ALIGN;
+    fwrite(zeros, 1, padding, out);
+    return offset + padding;
+}
+
+bool LevelFile::write(const std::string& path, const Map& map, const std::vector<Sprite*>& sprites, EntityHandler* entities)
+{
+    LevelHeader header;
+    header.width = map.xSize();
+    header.height = map.ySize();
+    header.skyTexture = map.getSkyTexture();
+    header.chunkCount = map.chunkCount();
+
+    std::vector<DoorRecord> doorRecords;
+    for (const Door& d : map.getDoors())
+    {
+        DoorRecord r = {};
+        r.texIndex = d.texIndex;
+        r.ID = d.ID;
+        r.x = d.x;
+        r.y = d.y;
+        r.doorProgress = d.doorProgress;
+        r.doorTime = d.doorTime;
+        r.exists = d.exists;
+        r.doorState = d.doorState;
+        r.orientation = d.orientation;
+        r.state = d.state;
+        doorRecords.push_back(r);
+    }
+
+    std::vector<SpriteRecord> spriteRecords;
+    std::vector<Sint32> pool;
+    auto addList = [&](const std::vector<int>& list, Uint32& first, Uint32& count) {
+        first = pool.size();
+        count = list.size();
+        pool.insert(pool.end(), list.begin(), list.end());
+    };
+    for (const Sprite* s : sprites)
+    {
+        SpriteRecord r = {};
+        r.x = s->x;
+        r.y = s->y;
+        r.texIndex = s->texIndex;
+        r.angle = s->angle;
+        r.animated = s->animated;
+        r.multiAngle = s->multiAngle;
+        addList(s->animIndexes, r.animFirst, r.animCount);
+        addList(s->angleIndexes, r.angleFirst, r.angleCount);
+        //reel lists first, then the first/count pairs pointing at them
+        std::vector<int> reels;
+        for (const std::vector<int>& reel : s->animIndexesAngled)
+        {
+            Uint32 first, count;
+            addList(reel, first, count);
+            reels.push_back(first);
+            reels.push_back(count);
+        }
+        addList(reels, r.reelFirst, r.reelCount);
+        r.reelCount /= 2;
+        spriteRecords.push_back(r);
+    }
+
+    std::vector<SpawnRecord> spawnRecords;
+    if (entities)
+    {
+        const std::vector<Entity*>& list = entities->getEntityVec();
+        for (size_t i = 0; i < list.size(); i++)
+        {
+            SpawnRecord r = {};
+            r.x = list[i]->pos.x;
+            r.y = list[i]->pos.y;
+            r.radius = list[i]->radius;
+            r.HP = list[i]->HP;
+            r.sprite = -1;
+            if (list[i]->sprite)
+            {
+                auto it = std::find(sprites.begin(), sprites.end(), list[i]->sprite);
+                if (it == sprites.end())
+                {
+                    std::cerr << "Entity " << list[i]->ID << "'s sprite isn't in the sprite list, not writing " << path << "\n";
+                    return false;
+                }
+                r.sprite = static_cast<Sint32>(it - sprites.begin());
+            }
+            strncpy(r.type, list[i]->nametype.c_str(), sizeof(r.type) - 1);
+            spawnRecords.push_back(r);
+        }
+    }
+
+    FILE* out = fopen(path.c_str(), "wb");
+    if (!out) return false;
+    bool ok = fwrite(&header, sizeof(header), 1, out) == 1; //placeholder, rewritten once the offsets are known
+    Uint64 offset = alignFile(out, sizeof(header));
+    header.cellOffset = offset;
+    std::unique_ptr<Cell[]> cells(new Cell[nva::CHUNK_CELLS]);
+    for (int i = 0; ok && i < map.chunkCount(); i++)
+        ok = map.copyChunk(i, cells.get()) && fwrite(cells.get(), sizeof(Cell), nva::CHUNK_CELLS, out) == static_cast<size_t>(nva::CHUNK_CELLS);
+    offset += header.chunkCount * nva::CHUNK_CELLS * sizeof(Cell);
+    //every section goes through the same pad, record, write steps
+    auto writeSection = [&](const void* data, Uint64 count, Uint64 size, Uint64& sectionOffset, Uint64& sectionCount) {
+        offset = alignFile(out, offset);
+        sectionOffset = offset;
+        sectionCount = count;
+        if (count) ok = ok && fwrite(data, size, count, out) == count;
+        offset += count * size;
+    };
+    writeSection(doorRecords.data(), doorRecords.size(), sizeof(DoorRecord), header.doorOffset, header.doorCount);
+    writeSection(spriteRecords.data(), spriteRecords.size(), sizeof(SpriteRecord), header.spriteOffset, header.spriteCount);
+    writeSection(pool.data(), pool.size(), sizeof(Sint32), header.poolOffset, header.poolCount);
+    writeSection(spawnRecords.data(), spawnRecords.size(), sizeof(SpawnRecord), header.spawnOffset, header.spawnCount);
+    ok = ok && fseek(out, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, out) == 1;
+    fclose(out);
+    return ok;
+}
@@ -0,0 +1,142 @@
+/*
+
+Copyright © 2023 Matthew Moore
+
+This engine is free software. You can redistribute it and/or modify it under the terms of the License below.
+The Nova SDL Game Library is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+
+This engine is licensed under a Creative Commons Attribution-ShareAlike 4.0 International License.
+https://creativecommons.org/licenses/by-sa/4.0/
+
+ You are free to:
+
+    Share — copy and redistribute the material in any medium or format for any purpose, even commercially.
+    Adapt — remix, transform, and build upon the material for any purpose, even commercially. 
+
+ Under the following terms:
+
+    Attribution - You must give appropriate credit, provide a link to the license, and indicate if changes were made. You may do so in any reasonable manner, but not in any way that suggests the licensor endorses you or your use.
+    ShareAlike - If you remix, transform, or build upon the material, you must distribute your contributions under the same license as the original. 
+
+*/
+#ifndef LEVELFILE_HPP
+#define LEVELFILE_HPP
+#include "engine.hpp"
+#include <string>
+
+//Binary level format. Everything is fixed width little endian and every section starts on a 64 byte boundary,
+//cells are stored chunk by chunk in the exact layout Map uses so a mapped file is used in place without parsing
+//  LevelHeader | cells (chunk order) | DoorRecord[] | SpriteRecord[] | Sint32 pool | SpawnRecord[]
+const Uint32 LEVEL_VERSION = 1;
+
+struct LevelHeader
+{
+    char magic[4] = {'N', 'V', 'L', 'V'};
+    Uint32 version = LEVEL_VERSION;
+    Uint32 headerSize = sizeof(LevelHeader);
+    Sint32 width = 0;
+    Sint32 height = 0;
+    Sint32 chunkShift = nva::CHUNK_SHIFT;
+    Sint32 skyTexture = 0;
+    Uint32 cellSize = sizeof(Cell);
+    Uint64 cellOffset = 0;
+    Uint64 chunkCount = 0;
+    Uint64 doorOffset = 0;
+    Uint64 doorCount = 0;
+    Uint64 spriteOffset = 0;
+    Uint64 spriteCount = 0;
+    Uint64 poolOffset = 0; //ints the sprite animation lists point into
+    Uint64 poolCount = 0;
+    Uint64 spawnOffset = 0;
+    Uint64 spawnCount = 0;
+};
+
+struct DoorRecord
+{
+    Sint32 texIndex;
+    Sint32 ID;
+    Sint32 x, y;
+    double doorProgress;
+    double doorTime;
+    Uint8 exists, doorState, orientation, state;
+    Uint32 pad;
+};
+
+//lists are [first, count) ranges in the int pool, angled reels are stored as first/count pairs in the pool too
+struct SpriteRecord
+{
+    double x, y;
+    Sint32 texIndex;
+    Sint32 angle;
+    Uint8 animated, multiAngle, pad[2];
+    Uint32 animFirst, animCount;
+    Uint32 angleFirst, angleCount;
+    Uint32 reelFirst, reelCount;
+};
+
+struct SpawnRecord
+{
+    double x, y;
+    double radius;
+    Sint32 HP;
+    Sint32 sprite; //index into the sprites, -1 for an entity without one
+    char type[32];
+};
+
+//What a level carries besides the grid. The caller owns these and hands them to the map / EntityController
+struct EntitySpawn
+{
+    Entity entity;
+    int sprite = -1;
+};
+
+//Read only file mapping. Pages are copy on write so the map can still edit cells without touching the file
+class MappedFile
+{
+public:
+    MappedFile() {};
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile() { close(); };
+    bool open(const std::string& path);
+    void close();
+    Uint8* data() const { return base; };
+    size_t size() const { return length; };
+private:
+    Uint8* base = nullptr;
+    size_t length = 0;
+#ifdef _WIN32
+    void* file = nullptr;
+    void* mapping = nullptr;
+#endif
+};
+
+//pads a file being written out to the next 64 byte section boundary, returns the new offset
+Uint64 alignFile(FILE* out, Uint64 offset);
+
+class LevelFile
+{
+public:
+    //maps the file and checks the header, the section bounds and that every cell's door index and texture ids
+    //(against a set of textureCount textures) are in range, since the map indexes with them unchecked
+    bool open(const std::string& path, int textureCount);
+    bool isOpen() const { return mapped != nullptr; };
+    const LevelHeader& header() const { return *reinterpret_cast<const LevelHeader*>(mapped->data()); };
+    Cell* chunkCells(int chunk) const;
+    std::vector<Door> doors() const;
+    std::vector<Sprite> sprites() const;
+    std::vector<EntitySpawn> spawns() const;
+    //hands the mapping over to a Map that keeps using it as its cell storage
+    std::unique_ptr<MappedFile> releaseMapping() { return std::move(mapped); };
+    //Converter from the in code representation. Each entity's spawn points at the sprite it was paired with
+    //through EntityController::createEntityAndSpriteAt, other sprites and entities are saved on their own.
+    //Fails if a paired sprite isn't in sprites
+    static bool write(const std::string& path, const Map& map, const std::vector<Sprite*>& sprites, EntityHandler* entities);
+private:
+    template <typename T> const T* section(Uint64 offset) const { return reinterpret_cast<const T*>(mapped->data() + offset); };
+    std::unique_ptr<MappedFile> mapped;
+};
+
+
+#endif
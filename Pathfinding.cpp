@@ -21,39 +21,23 @@ https://creativecommons.org/licenses/by-sa/4.0/
 
 */
 #include "Pathfinding.hpp"
-#include <stack>
 
 void Pathfinder::setMap(Map* m) { map = m; xmax = map->xSize(); ymax = map->ySize(); };
 
-std::vector<Node> Pathfinder::makePath(std::vector<std::vector<Node>> map, Node dest) {
-    try {
-        //std::cout << "Found a path" << std::endl;
-        int x = dest.pos.x;
-        int y = dest.pos.y;
-        std::stack<Node> path;
-        std::vector<Node> usablePath;
-        //std::cout << "before map check" << std::endl;
-        while (!(map[x][y].parent.x == x && map[x][y].parent.y == y)
-            && map[x][y].pos.x != -1 && map[x][y].pos.y != -1) 
-        {
-            path.push(map[x][y]);
-            //std::cout << "after map check" << std::endl;
-            int tempX = map[x][y].parent.x;
-            int tempY = map[x][y].parent.y;
-            x = tempX;
-            y = tempY;
-        }
-        path.push(map[x][y]);
-        while (!path.empty()) {
-            Node top = path.top();
-            path.pop();
-            usablePath.emplace_back(top);
-        }
-        return usablePath;
-    }
-    catch(const _exception& e){
-        std::cout << e.name << std::endl;
+std::vector<Node> Pathfinder::makePath(Node dest) {
+    int x = dest.pos.x;
+    int y = dest.pos.y;
+    std::vector<Node> usablePath;
+    while (true)
+    {
+        const PathCell& c = state(x, y);
+        usablePath.push_back({ {static_cast<double>(x), static_cast<double>(y)}, c.parent, c.gCost, c.hCost, c.fCost });
+        if (c.parent.x == x && c.parent.y == y) break;
+        x = c.parent.x;
+        y = c.parent.y;
     }
+    std::reverse(usablePath.begin(), usablePath.end());
+    return usablePath;
 }
 
 bool Pathfinder::isValid(int x, int y)
@@ -61,10 +45,7 @@ bool Pathfinder::isValid(int x, int y)
     if (x < 0 || y < 0 || x >= (xmax) || y >= (ymax)) {
         return false;
     }
-    if (map->getTileAt(x,y) == 0) return true;
-    if (map->getTileAt(x,y) > 0) return false;
-    if (map->getDoorTileAt(x,y).state == DOOR_CLOSED || map->getDoorTileAt(x,y).state == DOOR_CLOSING) return false;
-    return false;
+    return map->isWalkable(x, y);
 }
 
 bool Pathfinder::isDest(int x, int y, Node dest) {
@@ -80,6 +61,48 @@ double Pathfinder::calculateH(int x, int y, Node dest) {
     return H;
 }
 
+inline PathCell& Pathfinder::state(int x, int y)
+{
+    PathCell& c = pool[x * ymax + y];
+    if (c.generation != generation)
+    {
+        c = PathCell();
+        c.generation = generation;
+    }
+    return c;
+}
+
+//min heap on f cost, ties go to whichever was pushed first
+static bool laterInOpen(const OpenNode& a, const OpenNode& b)
+{
+    return a.fCost > b.fCost || (a.fCost == b.fCost && a.order > b.order);
+}
+
+//Starts a new generation so every cell reads as unvisited again
+void Pathfinder::beginSearch()
+{
+    const size_t cells = static_cast<size_t>(xmax) * ymax;
+    if (pool.size() != cells)
+    {
+        pool.assign(cells, PathCell());
+        generation = 0;
+    }
+    if (++generation == 0)
+    {
+        for (PathCell& c : pool) c.generation = 0;
+        generation = 1;
+    }
+    open.clear();
+    pushes = 0;
+    expansions = 0;
+}
+
+void Pathfinder::pushOpen(const PathCell& c, int x, int y)
+{
+    open.push_back({ c.fCost, c.gCost, pushes++, x, y });
+    std::push_heap(open.begin(), open.end(), laterInOpen);
+}
+
 std::vector<Node> Pathfinder::aStar(Node player, Node dest) 
 {
     std::vector<Node> empty;
@@ -93,95 +116,211 @@ std::vector<Node> Pathfinder::aStar(Node player, Node dest)
         return empty;
         //You clicked on yourself
     }
-    bool closedList[(xmax)][(ymax)];
-    //Initialize whole map
-    std::vector<std::vector<Node>> allMap(xmax, std::vector<Node>(ymax));
-    for (int x = 0; x < (xmax); x++) {
-        for (int y = 0; y < (ymax); y++) {
-            allMap[x][y].fCost = std::numeric_limits<float>::max();
-            allMap[x][y].gCost = std::numeric_limits<float>::max();
-            allMap[x][y].hCost = std::numeric_limits<float>::max();
-            allMap[x][y].parent.x = -1;
-            allMap[x][y].parent.y = -1;
-            allMap[x][y].pos.x = x;
-            allMap[x][y].pos.y = y;
-            closedList[x][y] = false;
-        }
-    }
+    const size_t cells = static_cast<size_t>(xmax) * ymax;
+    beginSearch();
     //Initialize our starting list
     int x = player.pos.x;
     int y = player.pos.y;
-    allMap[x][y].fCost = 0.0;
-    allMap[x][y].gCost = 0.0;
-    allMap[x][y].hCost = 0.0;
-    allMap[x][y].parent.x = x;
-    allMap[x][y].parent.y = y;
-    std::vector<Node> openList;  
-    openList.emplace_back(allMap[x][y]);
-    bool destinationFound = false;
-    while (!openList.empty()&&openList.size()<(xmax)*(ymax)) {
-        Node node;
+    PathCell& start = state(x, y);
+    start.fCost = 0.0;
+    start.gCost = 0.0;
+    start.hCost = 0.0;
+    start.parent = { static_cast<double>(x), static_cast<double>(y) };
+    pushOpen(start, x, y);
+    //the cap counts stale copies too, same as the old open list vector did
+    while (!open.empty() && open.size() < cells) {
+        OpenNode node;
         bool validNodeFound = false;
         do {
-            float temp = std::numeric_limits<float>::max();
-            std::vector<Node>::iterator itNode = openList.begin();
-            
-            for (std::vector<Node>::iterator it = openList.begin();
-                it != openList.end(); it = next(it)) {
-                Node n = *it;
-                if (n.fCost < temp) {
-                    temp = n.fCost;
-                    itNode = it;
-                }
-            }
-            node = *itNode;
-            if(isValid(node.pos.x, node.pos.y)) {
+            std::pop_heap(open.begin(), open.end(), laterInOpen);
+            node = open.back();
+            open.pop_back();
+            if (isValid(node.x, node.y)) {
                 validNodeFound = true;
             }
-            if(!openList.empty()) openList.erase(itNode);
-        } while (!validNodeFound && !openList.empty());
-        x = node.pos.x;
-        y = node.pos.y;
-        closedList[x][y] = true;
+        } while (!validNodeFound && !open.empty());
+        x = node.x;
+        y = node.y;
+        state(x, y).closed = true;
+        expansions++;
         //For each neighbour starting from North-West to South-East
         for (int newX = -1; newX <= 1; newX++) {
             for (int newY = -1; newY <= 1; newY++) {
-                double gNew, hNew, fNew;
-                if (isValid(x + newX, y + newY)) {
-                    if (isDest(x + newX, y + newY, dest))
-                    {
-                        //Destination found - make path
-                        allMap[x + newX][y + newY].parent.x = x;
-                        allMap[x + newX][y + newY].parent.y = y;
-                        destinationFound = true;
-                        return makePath(allMap, dest);
-                    }
-                    else if (closedList[x + newX][y + newY] == false)
+                if (!isValid(x + newX, y + newY)) continue;
+                PathCell& next = state(x + newX, y + newY);
+                if (isDest(x + newX, y + newY, dest))
+                {
+                    //Destination found - make path
+                    next.parent = { static_cast<double>(x), static_cast<double>(y) };
+                    return makePath(dest);
+                }
+                else if (!next.closed)
+                {
+                    //a stale copy expands with the g cost it was pushed with
+                    double gNew = node.gCost + 1.0;
+                    double hNew = calculateH(x + newX, y + newY, dest);
+                    double fNew = gNew + hNew;
+                    // Check if this path is better than the one already present
+                    if (next.fCost == std::numeric_limits<float>::max() || next.fCost > fNew)
                     {
-                        gNew = node.gCost + 1.0;
-                        hNew = calculateH(x + newX, y + newY, dest);
-                        fNew = gNew + hNew;
-                        // Check if this path is better than the one already present
-                        if (allMap[x + newX][y + newY].fCost == std::numeric_limits<float>::max() ||
-                            allMap[x + newX][y + newY].fCost > fNew)
-                        {
-                            // Update the details of this neighbour node
-                            allMap[x + newX][y + newY].fCost = fNew;
-                            allMap[x + newX][y + newY].gCost = gNew;
-                            allMap[x + newX][y + newY].hCost = hNew;
-                            allMap[x + newX][y + newY].parent.x = x;
-                            allMap[x + newX][y + newY].parent.y = y;
-                            openList.emplace_back(allMap[x + newX][y + newY]);
-                        }
+                        // Update the details of this neighbour node
+                        next.fCost = fNew;
+                        next.gCost = gNew;
+                        next.hCost = hNew;
+                        next.parent = { static_cast<double>(x), static_cast<double>(y) };
+                        pushOpen(next, x + newX, y + newY);
                     }
                 }
             }
         }
+    }
+    //std::cout << "Destination not found" << std::endl;
+    return empty;
+}
+
+//octile distance, the cost of the cheapest 8 way walk between two cells on an open grid
+static double octile(int ax, int ay, int bx, int by)
+{
+    const int dx = std::abs(ax - bx), dy = std::abs(ay - by);
+    return std::max(dx, dy) + (M_SQRT2 - 1) * std::min(dx, dy);
+}
+
+//Walks from x, y in one direction until something forces a turn. Leaves x, y on the jump point and returns true,
+//false if it runs into a wall first. A diagonal step stops wherever a straight jump off it would find something
+bool Pathfinder::jump(int& x, int& y, int dx, int dy, const Node& dest)
+{
+    while (true)
+    {
+        x += dx;
+        y += dy;
+        if (!isValid(x, y)) return false;
+        if (isDest(x, y, dest)) return true;
+        if (dx && dy)
+        {
+            if ((!isValid(x - dx, y) && isValid(x - dx, y + dy)) || (!isValid(x, y - dy) && isValid(x + dx, y - dy))) return true;
+            int sx = x, sy = y;
+            if (jump(sx, sy, dx, 0, dest)) return true;
+            sx = x;
+            sy = y;
+            if (jump(sx, sy, 0, dy, dest)) return true;
+        }
+        else if (dx)
+        {
+            if ((!isValid(x, y + 1) && isValid(x + dx, y + 1)) || (!isValid(x, y - 1) && isValid(x + dx, y - 1))) return true;
+        }
+        else
+        {
+            if ((!isValid(x + 1, y) && isValid(x + 1, y + dy)) || (!isValid(x - 1, y) && isValid(x - 1, y + dy))) return true;
+        }
+    }
+}
+
+std::vector<Node> Pathfinder::jps(Node player, Node dest)
+{
+    std::vector<Node> empty;
+    if (!isValid(dest.pos.x, dest.pos.y)) return empty;
+    if (isDest(player.pos.x, player.pos.y, dest)) return empty;
+    beginSearch();
+    const int destX = dest.pos.x, destY = dest.pos.y;
+    int x = player.pos.x;
+    int y = player.pos.y;
+    PathCell& start = state(x, y);
+    start.gCost = 0.0;
+    start.hCost = octile(x, y, destX, destY);
+    start.fCost = start.hCost;
+    start.parent = { static_cast<double>(x), static_cast<double>(y) };
+    pushOpen(start, x, y);
+    while (!open.empty())
+    {
+        std::pop_heap(open.begin(), open.end(), laterInOpen);
+        const OpenNode node = open.back();
+        open.pop_back();
+        PathCell& current = state(node.x, node.y);
+        if (current.closed || node.gCost > current.gCost) continue; //stale copy
+        current.closed = true;
+        expansions++;
+        x = node.x;
+        y = node.y;
+        if (x == destX && y == destY) break;
+        //directions worth trying, everything from the start, otherwise the way we came plus any forced turns
+        int dirs[8][2];
+        int count = 0;
+        auto add = [&](int dx, int dy) { dirs[count][0] = dx; dirs[count][1] = dy; count++; };
+        if (current.parent.x == x && current.parent.y == y)
+        {
+            for (int dx = -1; dx <= 1; dx++)
+                for (int dy = -1; dy <= 1; dy++)
+                    if (dx || dy) add(dx, dy);
+        }
+        else
+        {
+            const int dx = (x > current.parent.x) - (x < current.parent.x);
+            const int dy = (y > current.parent.y) - (y < current.parent.y);
+            if (dx && dy)
+            {
+                add(dx, 0);
+                add(0, dy);
+                add(dx, dy);
+                if (!isValid(x - dx, y) && isValid(x - dx, y + dy)) add(-dx, dy);
+                if (!isValid(x, y - dy) && isValid(x + dx, y - dy)) add(dx, -dy);
+            }
+            else if (dx)
+            {
+                add(dx, 0);
+                if (!isValid(x, y + 1) && isValid(x + dx, y + 1)) add(dx, 1);
+                if (!isValid(x, y - 1) && isValid(x + dx, y - 1)) add(dx, -1);
+            }
+            else
+            {
+                add(0, dy);
+                if (!isValid(x + 1, y) && isValid(x + 1, y + dy)) add(1, dy);
+                if (!isValid(x - 1, y) && isValid(x - 1, y + dy)) add(-1, dy);
+            }
+        }
+        for (int d = 0; d < count; d++)
+        {
+            int jx = x, jy = y;
+            if (!jump(jx, jy, dirs[d][0], dirs[d][1], dest)) continue;
+            PathCell& next = state(jx, jy);
+            if (next.closed) continue;
+            const double gNew = current.gCost + octile(x, y, jx, jy);
+            if (gNew < next.gCost)
+            {
+                next.gCost = gNew;
+                next.hCost = octile(jx, jy, destX, destY);
+                next.fCost = gNew + next.hCost;
+                next.parent = { static_cast<double>(x), static_cast<double>(y) };
+                pushOpen(next, jx, jy);
+            }
+        }
+    }
+    if (!state(destX, destY).closed) return empty;
+    //jump points back to the start, then every cell between them filled in. Each jump is one straight or
+    //diagonal run so the cells in between are just steps towards the parent
+    std::vector<Node> path;
+    x = destX;
+    y = destY;
+    while (true)
+    {
+        const PathCell& c = state(x, y);
+        path.push_back({ {static_cast<double>(x), static_cast<double>(y)}, c.parent, c.gCost, c.hCost, c.fCost });
+        if (c.parent.x == x && c.parent.y == y) break;
+        const int px = c.parent.x, py = c.parent.y;
+        const int dx = (px > x) - (px < x), dy = (py > y) - (py < y);
+        float g = c.gCost;
+        for (int cx = x + dx, cy = y + dy; cx != px || cy != py; cx += dx, cy += dy)
+        {
+            g -= (dx && dy) ? M_SQRT2 : 1.0;
+            const float h = octile(cx, cy, destX, destY);
+            path.back().parent = { static_cast<double>(cx), static_cast<double>(cy) };
+            path.push_back({ {static_cast<double>(cx), static_cast<double>(cy)}, {0, 0}, g, h, g + h });
         }
-        if (destinationFound == false) {
-            //std::cout << "Destination not found" << std::endl;
-            return empty;
+        path.back().parent = { static_cast<double>(px), static_cast<double>(py) };
+        x = px;
+        y = py;
     }
+    std::reverse(path.begin(), path.end());
+    return path;
 }
 
 double Pathfinder::calcAngle(const Point& p1, const Point& p2)
@@ -192,4 +331,104 @@ double Pathfinder::calcAngle(const Point& p1, const Point& p2)
     angle = angle * 180 / M_PI;
     angle = fmod(angle + 360, 360);
     return angle; // returns angles in degrees
-}
\ No newline at end of file
+}
+//neighbour offsets for FlowField::Field::step
+static const int FLOW_DX[8] = { -1, 0, 1, -1, 1, -1, 0, 1 };
+static const int FLOW_DY[8] = { -1, -1, -1, 0, 0, 1, 1, 1 };
+
+FlowField::FlowField() : worker(new WorkerPool(2)) {}
+
+FlowField::~FlowField()
+{
+    if (building) while (!worker->waitFor(100)) {}
+}
+
+void FlowField::setMap(Map* m)
+{
+    if (building) while (!worker->waitFor(100)) {}
+    map = m;
+    current = Field();
+    pending = Field();
+    requested = building = ready = false;
+}
+
+void FlowField::update(Point target)
+{
+    if (!map) return;
+    if (building && worker->waitFor(0)) finish();
+    if (building) return;
+    const int tx = target.x, ty = target.y;
+    if (requested && tx == targetX && ty == targetY && map->getLayoutRevision() == revision) return;
+    targetX = tx;
+    targetY = ty;
+    revision = map->getLayoutRevision();
+    requested = true;
+    const int w = map->xSize(), h = map->ySize();
+    pending.width = w;
+    pending.height = h;
+    pending.walkable = map->getWalkField(); //a copy, the map keeps changing on this thread while the worker builds
+    building = true;
+    worker->start(1, [this, tx, ty](int, int) { build(tx, ty); });
+}
+
+void FlowField::finish()
+{
+    std::swap(current, pending);
+    building = false;
+    ready = true;
+    builds++;
+}
+
+//Dijkstra out from the target over the snapshot, every cell reached points back at the neighbour it was reached from.
+//Same moves as the searches, 8 way and diagonals may cut corners
+void FlowField::build(int tx, int ty)
+{
+    Field& f = pending;
+    const int w = f.width, h = f.height;
+    const size_t cells = static_cast<size_t>(w) * h;
+    f.distance.assign(cells, std::numeric_limits<float>::max());
+    f.step.assign(cells, NO_STEP);
+    heap.clear();
+    if (tx < 0 || ty < 0 || tx >= w || ty >= h) return;
+    const auto later = [](const std::pair<float, int>& a, const std::pair<float, int>& b) { return a.first > b.first; };
+    f.distance[ty * w + tx] = 0;
+    heap.push_back({ 0.0f, ty * w + tx });
+    while (!heap.empty())
+    {
+        std::pop_heap(heap.begin(), heap.end(), later);
+        const std::pair<float, int> top = heap.back();
+        heap.pop_back();
+        if (top.first > f.distance[top.second]) continue; //stale
+        const int x = top.second % w, y = top.second / w;
+        for (int d = 0; d < 8; d++)
+        {
+            const int nx = x + FLOW_DX[d], ny = y + FLOW_DY[d];
+            if (nx < 0 || ny < 0 || nx >= w || ny >= h) continue;
+            const int n = ny * w + nx;
+            if (!f.walkable[n]) continue;
+            const float dist = top.first + ((FLOW_DX[d] && FLOW_DY[d]) ? static_cast<float>(M_SQRT2) : 1.0f);
+            if (dist < f.distance[n])
+            {
+                f.distance[n] = dist;
+                f.step[n] = 7 - d; //the opposite offset, back towards where it came from
+                heap.push_back({ dist, n });
+                std::push_heap(heap.begin(), heap.end(), later);
+            }
+        }
+    }
+}
+
+Point FlowField::nextStep(int x, int y) const
+{
+    if (!ready || x < 0 || y < 0 || x >= current.width || y >= current.height) return { -1, -1 };
+    const Uint8 d = current.step[y * current.width + x];
+    if (d == NO_STEP) return { -1, -1 };
+    return { static_cast<double>(x + FLOW_DX[d]), static_cast<double>(y + FLOW_DY[d]) };
+}
+
+double FlowField::distanceAt(int x, int y) const
+{
+    if (!ready || x < 0 || y < 0 || x >= current.width || y >= current.height) return -1;
+    const float d = current.distance[y * current.width + x];
+    return (d == std::numeric_limits<float>::max()) ? -1 : d;
+}
@@ -23,6 +23,7 @@ https://creativecommons.org/licenses/by-sa/4.0/
 #ifndef PATHFINDING_HPP
 #define PATHFINDING_HPP
 #include "engine.hpp"
+#include <limits>
 // followed tutorial at https://dev.to/jansonsa/a-star-a-path-finding-c-4a4h
 // to implement
 struct Node
@@ -38,6 +39,26 @@ inline bool operator<(const Node& lhs, const Node& rhs)
     return lhs.fCost < rhs.fCost;
 }
 
+//Search state for one cell, only trusted when generation matches the current search so bumping the
+//generation resets the whole pool without touching it
+struct PathCell
+{
+    float gCost = std::numeric_limits<float>::max();
+    float hCost = std::numeric_limits<float>::max();
+    float fCost = std::numeric_limits<float>::max();
+    Point parent = {-1, -1};
+    bool closed = false;
+    Uint32 generation = 0;
+};
+//Open list entry, a copy of the node as it was when pushed so a cell can be in the heap more than once
+struct OpenNode
+{
+    float fCost;
+    float gCost;
+    Uint32 order; //push order, equal f costs come out first in first out
+    int x, y;
+};
+
 class Pathfinder
 {
 public:
@@ -46,12 +67,69 @@ public:
     bool isDest(int x, int y, Node dest);
     double calculateH(int x, int y, Node dest);
     std::vector<Node> aStar(Node player, Node dest);
-    std::vector<Node> makePath(std::vector<std::vector<Node>> allMap, Node dest);
+    //Jump Point Search over the same cells isValid allows. Diagonals cost sqrt 2 here (aStar charges 1) which is
+    //what lets it skip straight runs. Still hands back every cell of the path, start first, like aStar
+    std::vector<Node> jps(Node player, Node dest);
+    //nodes the last aStar or jps call expanded
+    Uint64 getExpansions() const { return expansions; };
+    //walks the parents from dest back to the start of the last search
+    std::vector<Node> makePath(Node dest);
     static double calcAngle(const Point&, const Point&);
 private:
     Map* map = nullptr;
     int xmax = 0, ymax = 0;
+    //kept between searches so a search doesn't allocate once they've grown to the map
+    std::vector<PathCell> pool;
+    std::vector<OpenNode> open;
+    Uint32 generation = 0;
+    Uint32 pushes = 0;
+    Uint64 expansions = 0;
+    PathCell& state(int x, int y);
+    void pushOpen(const PathCell& c, int x, int y);
+    void beginSearch();
+    bool jump(int& x, int& y, int dx, int dy, const Node& dest);
 };
 
+//Walking directions toward one target from every cell, shared by everything chasing it so lookups are O(1) however
+//many there are. Rebuilt with Dijkstra on a worker when the target moves to another cell or the map's layout
+//revision changes. Lookups read the last finished field so they never wait on a rebuild
+class FlowField
+{
+public:
+    FlowField();
+    ~FlowField();
+    void setMap(Map* m);
+    //call from the game thread every tick. Swaps in a finished rebuild and starts the next one when it's needed.
+    //Copies the map's walk field here since edits and chunk streaming only happen on this thread
+    void update(Point target);
+    //cell to step into from x, y towards the target, {-1, -1} when it can't be reached or there's no field yet
+    Point nextStep(int x, int y) const;
+    //walking distance to the target in cells with diagonals costing sqrt 2, -1 when it can't be reached
+    double distanceAt(int x, int y) const;
+    bool isReady() const { return ready; };
+    bool isBuilding() const { return building; };
+    Uint64 getBuilds() const { return builds; };
+private:
+    struct Field
+    {
+        int width = 0, height = 0;
+        std::vector<Uint8> walkable;
+        std::vector<float> distance;
+        std::vector<Uint8> step; //index into the neighbour offsets, NO_STEP where there's nowhere to go
+    };
+    static constexpr Uint8 NO_STEP = 255;
+    Map* map = nullptr;
+    Field current, pending;
+    std::vector<std::pair<float, int>> heap; //only touched by the build
+    int targetX = -1, targetY = -1; //what the latest build was started for
+    Uint64 revision = 0;
+    bool requested = false;
+    bool building = false;
+    bool ready = false;
+    Uint64 builds = 0;
+    std::unique_ptr<WorkerPool> worker;
+    void build(int tx, int ty);
+    void finish();
+};
 
 #endif
\ No newline at end of file
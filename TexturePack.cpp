@@ -0,0 +1,175 @@
+/*
+
+Copyright © 2023 Matthew Moore
+
+This engine is free software. You can redistribute it and/or modify it under the terms of the License below.
+The Nova SDL Game Library is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+
+This engine is licensed under a Creative Commons Attribution-ShareAlike 4.0 International License.
+https://creativecommons.org/licenses/by-sa/4.0/
+
+ You are free to:
+
+    Share — copy and redistribute the material in any medium or format for any purpose, even commercially.
+    Adapt — remix, transform, and build upon the material for any purpose, even commercially. 
+
+ Under the following terms:
+
+    Attribution - You must give appropriate credit, provide a link to the license, and indicate if changes were made. You may do so in any reasonable manner, but not in any way that suggests the licensor endorses you or your use.
+    ShareAlike - If you remix, transform, or build upon the material, you must distribute your contributions under the same license as the original. 
+
+*/
+#include "TexturePack.hpp"
+#include <cstring>
+#include <cstdio>
+#include <sys/stat.h>
+
+//texel bytes of one mip level, padded so the next level starts on a section boundary like the file does
+static Uint64 levelSpan(int w, int h)
+{
+    return (static_cast<Uint64>(w) * h * sizeof(Uint32) + 63) & ~Uint64(63);
+}
+
+static bool statImage(const std::string& path, Sint64& mtime, Uint64& size)
+{
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) return false;
+    mtime = static_cast<Sint64>(st.st_mtime);
+    size = static_cast<Uint64>(st.st_size);
+    return true;
+}
+
+bool TexturePack::open(const std::string& path)
+{
+    index.clear();
+    mapped.reset(new MappedFile());
+    if (!mapped->open(path))
+    {
+        mapped.reset(); //no pack yet is the normal first run, not an error
+        return false;
+    }
+    const TexturePackHeader expected;
+    const size_t size = mapped->size();
+    bool valid = size >= sizeof(TexturePackHeader);
+    const TexturePackHeader& h = header();
+    valid = valid && memcmp(h.magic, expected.magic, 4) == 0 && h.version == TEXTURE_PACK_VERSION && h.headerSize == sizeof(TexturePackHeader) &&
+            h.entrySize == sizeof(TexturePackEntry) && h.entryOffset % alignof(TexturePackEntry) == 0 &&
+            h.entryOffset <= size && h.entryCount <= (size - h.entryOffset) / sizeof(TexturePackEntry);
+    if (!valid)
+    {
+        std::cerr << "Texture pack " << path << " isn't a version " << TEXTURE_PACK_VERSION << " pack or is truncated, rebuilding it\n";
+        mapped.reset();
+        return false;
+    }
+    //names aren't guaranteed to be terminated, and the first of any duplicates wins like a scan would
+    index.reserve(h.entryCount);
+    for (Uint64 i = 0; i < h.entryCount; i++)
+        index.emplace(std::string(entries()[i].name, strnlen(entries()[i].name, sizeof(entries()[i].name))), &entries()[i]);
+    return true;
+}
+
+std::vector<Texture> TexturePack::lookup(const std::string& filename)
+{
+    std::vector<Texture> chain;
+    if (!isOpen()) return chain;
+    auto found = index.find(filename);
+    if (found == index.end() || filename.size() >= sizeof(found->second->name)) return chain;
+    const TexturePackEntry* entry = found->second;
+
+    //same timestamp and size is trusted, a new timestamp alone (a fresh checkout, a touch) falls back to the hash
+    Sint64 mtime;
+    Uint64 fileSize;
+    if (!statImage(nva::IMAGE_DIR + filename, mtime, fileSize) || fileSize != entry->fileSize) return chain;
+    if (mtime != entry->mtime)
+    {
+        Uint64 hash;
+        hashChecks++;
+        if (!hashFile(nva::IMAGE_DIR + filename, hash) || hash != entry->hash) return chain;
+    }
+
+    //the chain has to be the one halved() builds and fit in the file before anything points at it
+    int w = entry->width, h = entry->height;
+    Uint64 offset = entry->pixelOffset;
+    const Uint64 end = entry->pixelOffset + entry->pixelBytes;
+    if (w <= 0 || h <= 0 || entry->pixelOffset % 64 != 0 || entry->pixelBytes > mapped->size() || entry->pixelOffset > mapped->size() - entry->pixelBytes) return chain;
+    for (Uint32 level = 0; level < entry->mipCount; level++)
+    {
+        if (offset + levelSpan(w, h) > end) return std::vector<Texture>();
+        chain.push_back(Texture::view(reinterpret_cast<const Uint32*>(mapped->data() + offset), w, h));
+        offset += levelSpan(w, h);
+        if (w == 1 && h == 1) break;
+        w = std::max(1, w / 2);
+        h = std::max(1, h / 2);
+    }
+    if (chain.size() != entry->mipCount || chain.back().width != 1 || chain.back().height != 1) chain.clear();
+    return chain;
+}
+
+bool TexturePack::hashFile(const std::string& path, Uint64& hash)
+{
+    FILE* in = fopen(path.c_str(), "rb");
+    if (!in) return false;
+    hash = 14695981039346656037ULL;
+    unsigned char buffer[1 << 16];
+    size_t got;
+    while ((got = fread(buffer, 1, sizeof(buffer), in)) > 0)
+    {
+        for (size_t i = 0; i < got; i++)
+        {
+            hash ^= buffer[i];
+            hash *= 1099511628211ULL;
+        }
+    }
+    fclose(in);
+    return true;
+}
+
+bool TexturePack::write(const std::string& path, const std::vector<std::string>& names, const std::vector<std::vector<Texture>>& chains)
+{
+    TexturePackHeader header;
+    header.entryOffset = sizeof(TexturePackHeader);
+
+    //an image that didn't load has no stamp to check against and is left out of the pack
+    std::vector<TexturePackEntry> entryList;
+    std::vector<size_t> sources;
+    for (size_t i = 0; i < names.size(); i++)
+    {
+        TexturePackEntry entry = {};
+        if (names[i].size() >= sizeof(entry.name) || !statImage(nva::IMAGE_DIR + names[i], entry.mtime, entry.fileSize) ||
+            !hashFile(nva::IMAGE_DIR + names[i], entry.hash)) continue;
+        strncpy(entry.name, names[i].c_str(), sizeof(entry.name) - 1);
+        entry.width = chains[i][0].width;
+        entry.height = chains[i][0].height;
+        entry.mipCount = chains[i].size();
+        for (const Texture& level : chains[i]) entry.pixelBytes += levelSpan(level.width, level.height);
+        entryList.push_back(entry);
+        sources.push_back(i);
+    }
+    header.entryCount = entryList.size();
+    //lay the pixels out after the index so the entries can go in one write
+    Uint64 offset = (header.entryOffset + entryList.size() * sizeof(TexturePackEntry) + 63) & ~Uint64(63);
+    for (TexturePackEntry& entry : entryList)
+    {
+        entry.pixelOffset = offset;
+        offset += entry.pixelBytes;
+    }
+
+    FILE* out = fopen(path.c_str(), "wb");
+    if (!out) return false;
+    bool ok = fwrite(&header, sizeof(header), 1, out) == 1;
+    ok = ok && fwrite(entryList.data(), sizeof(TexturePackEntry), entryList.size(), out) == entryList.size();
+    offset = alignFile(out, header.entryOffset + entryList.size() * sizeof(TexturePackEntry));
+    for (size_t i = 0; ok && i < sources.size(); i++)
+    {
+        for (const Texture& level : chains[sources[i]])
+        {
+            const size_t count = static_cast<size_t>(level.width) * level.height;
+            ok = ok && fwrite(level.column(0), sizeof(Uint32), count, out) == count;
+            offset = alignFile(out, offset + count * sizeof(Uint32));
+        }
+    }
+    ok = (fclose(out) == 0) && ok;
+    if (!ok) remove(path.c_str());
+    return ok;
+}
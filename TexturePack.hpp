@@ -0,0 +1,80 @@
+/*
+
+Copyright © 2023 Matthew Moore
+
+This engine is free software. You can redistribute it and/or modify it under the terms of the License below.
+The Nova SDL Game Library is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+
+This engine is licensed under a Creative Commons Attribution-ShareAlike 4.0 International License.
+https://creativecommons.org/licenses/by-sa/4.0/
+
+ You are free to:
+
+    Share — copy and redistribute the material in any medium or format for any purpose, even commercially.
+    Adapt — remix, transform, and build upon the material for any purpose, even commercially. 
+
+ Under the following terms:
+
+    Attribution - You must give appropriate credit, provide a link to the license, and indicate if changes were made. You may do so in any reasonable manner, but not in any way that suggests the licensor endorses you or your use.
+    ShareAlike - If you remix, transform, or build upon the material, you must distribute your contributions under the same license as the original. 
+
+*/
+#ifndef TEXTUREPACK_HPP
+#define TEXTUREPACK_HPP
+#include "LevelFile.hpp"
+#include <string>
+#include <unordered_map>
+
+//Cache of decoded textures so startup doesn't run every image through stb_image again.
+//Texels are stored already packed column major with their whole mip chain, so a mapped pack is sampled in place
+//  TexturePackHeader | TexturePackEntry[] | mip chains, each level on a 64 byte boundary
+const Uint32 TEXTURE_PACK_VERSION = 1;
+
+//the source file's timestamp, size and hash decide if the cached texels are still good
+struct TexturePackEntry
+{
+    char name[128];
+    Sint64 mtime;
+    Uint64 fileSize;
+    Uint64 hash;
+    Sint32 width, height;
+    Uint32 mipCount;
+    Uint32 pad;
+    Uint64 pixelOffset; //mip levels follow each other, full size first
+    Uint64 pixelBytes;
+};
+
+struct TexturePackHeader
+{
+    char magic[4] = {'N', 'V', 'T', 'P'};
+    Uint32 version = TEXTURE_PACK_VERSION;
+    Uint32 headerSize = sizeof(TexturePackHeader);
+    Uint32 entrySize = sizeof(TexturePackEntry);
+    Uint64 entryOffset = 0;
+    Uint64 entryCount = 0;
+};
+
+class TexturePack
+{
+public:
+    //maps the pack and checks the header and entry bounds, false when there's no usable pack
+    bool open(const std::string& path);
+    bool isOpen() const { return mapped != nullptr; };
+    //mip chain viewing the mapping for an image, empty when the image isn't in the pack or changed since
+    std::vector<Texture> lookup(const std::string& filename);
+    //the views lookup hands out point into this, whoever keeps them keeps the mapping too
+    std::unique_ptr<MappedFile> releaseMapping() { return std::move(mapped); };
+    int getHashChecks() const { return hashChecks; };
+    static bool write(const std::string& path, const std::vector<std::string>& names, const std::vector<std::vector<Texture>>& chains);
+    //FNV-1a over the file, false when it can't be read
+    static bool hashFile(const std::string& path, Uint64& hash);
+private:
+    const TexturePackHeader& header() const { return *reinterpret_cast<const TexturePackHeader*>(mapped->data()); };
+    const TexturePackEntry* entries() const { return reinterpret_cast<const TexturePackEntry*>(mapped->data() + header().entryOffset); };
+    std::unique_ptr<MappedFile> mapped;
+    std::unordered_map<std::string, const TexturePackEntry*> index; //built by open so lookups don't scan the entries
+    int hashChecks = 0;
+};
+
+#endif
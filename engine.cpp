@@ -22,9 +22,16 @@ https://creativecommons.org/licenses/by-sa/4.0/
 */
 
 #include "engine.hpp"
+#include "LevelFile.hpp"
+#include "TexturePack.hpp"
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 #include <SDL2/SDL_ttf.h>
+#include <cstring>
+#include <chrono>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 // Game class implementation
 
 double Game::frameTime()
@@ -48,7 +55,7 @@ void Game::clrScreen(Uint8 r, Uint8 g, Uint8 b, Uint8 a)
 bool nva::loadImage(std::vector<unsigned char>& image, const std::string& filename, int& x, int&y)
 { 
     int n;
-    unsigned char* data = stbi_load(("./images/" + filename).c_str(), &x, &y, &n, 4);
+    unsigned char* data = stbi_load((nva::IMAGE_DIR + filename).c_str(), &x, &y, &n, 4);
     if (data != nullptr)
     {
         image = (std::vector<unsigned char>(data, data + x * y * 4));
@@ -88,6 +95,95 @@ void Game::setEventHandler(void(*ptr)(SDL_Event))
 }
 
 
+//WorkerPool implementation
+
+WorkerPool::WorkerPool(int maxThreads)
+{
+    int cores = static_cast<int>(std::thread::hardware_concurrency());
+    if (cores < 1) cores = 1;
+    int workers = std::min(cores, maxThreads);
+    for (int i = 1; i < workers; i++) threads.emplace_back(&WorkerPool::workerLoop, this, i);
+}
+
+WorkerPool::~WorkerPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (auto& thread : threads) thread.join();
+}
+
+void WorkerPool::runJobs(int worker)
+{
+    for (int job = nextJob++; job < jobCount; job = nextJob++) (*task)(job, worker);
+}
+
+void WorkerPool::workerLoop(int worker)
+{
+    Uint64 seen = 0;
+    while (true)
+    {
+        {
+            std::unique_lock<std::mutex> lock(mtx);
+            wake.wait(lock, [&]{ return stopping || generation != seen; });
+            if (stopping) return;
+            seen = generation;
+        }
+        runJobs(worker);
+        std::lock_guard<std::mutex> lock(mtx);
+        if (--busyWorkers == 0) finished.notify_one();
+    }
+}
+
+void WorkerPool::parallelFor(int jobs, const std::function<void(int, int)>& fn)
+{
+    if (jobs <= 0) return;
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        task = &fn;
+        jobCount = jobs;
+        nextJob = 0;
+        busyWorkers = threads.size();
+        generation++;
+    }
+    wake.notify_all();
+    runJobs(0);
+    std::unique_lock<std::mutex> lock(mtx);
+    finished.wait(lock, [&]{ return busyWorkers == 0; });
+    task = nullptr;
+}
+
+void WorkerPool::start(int jobs, std::function<void(int, int)> fn)
+{
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        startedTask = std::move(fn);
+        task = &startedTask;
+        jobCount = std::max(jobs, 0);
+        nextJob = 0;
+        busyWorkers = threads.size();
+        generation++;
+    }
+    wake.notify_all();
+}
+
+bool WorkerPool::waitFor(int ms)
+{
+    //single core, nobody else to run them so do one job per call and keep the caller responsive
+    if (threads.empty())
+    {
+        int job = nextJob++;
+        if (job < jobCount) (*task)(job, 0);
+        return job + 1 >= jobCount;
+    }
+    std::unique_lock<std::mutex> lock(mtx);
+    if (!finished.wait_for(lock, std::chrono::milliseconds(ms), [&]{ return busyWorkers == 0; })) return false;
+    task = nullptr;
+    return true;
+}
+
 //GridGame implementation
 
 void GridGame::drawGrid(int rows, int cols, rgba c)
@@ -124,86 +220,249 @@ void GridGame::mapGrid(rgba c)
     }
 }
 
-//Simple DDA
-inline CollisionEvent GridGame::ddaRaycast(Point start, double angle)
+inline CollisionEvent GridGame::ddaRaycast(Point start, double angle, Uint64* cellSteps) const
 {
     double angleRadians = angle * M_PI / 180.0;
     //using point as 2d vector to keep clean
     Point rayDir = { cos(angleRadians), sin(angleRadians) };
-    Point rayUnitStepSize = { sqrt( 1 + (rayDir.y / rayDir.x) * (rayDir.y / rayDir.x)), sqrt( 1 + (rayDir.x / rayDir.y) * (rayDir.x / rayDir.y)) };
-    Point mapCheck = { floor(start.x), floor(start.y) };
-    Point rayLength;
-    Point step;
-    if (rayDir.x < 0) 
+    return ddaRaycast(start, rayDir, cos(angleRadians - getAngle()*M_PI/180), cellSteps); //code fixes fish eye effect
+}
+
+//One ray's walk through the grid. Crossing n of the x grid lines is at first.x + n * unit.x and the same for y.
+//Crossings are counted and each distance is worked out from that instead of summed up, so jumping n crossings
+//ahead lands on exactly the distances single stepping would have reached
+struct RayWalk
+{
+    Point start, dir, unit, first, step, startCell, mapCheck;
+    double fishEye;
+    double crossingsX = 0, crossingsY = 0; //whole numbers, doubles so the packet caster can step them in vector registers
+    double distance = 0;
+    int side = 0;
+    double crossingX(double n) const { return first.x + n * unit.x; }
+    double crossingY(double n) const { return first.y + n * unit.y; }
+};
+
+static inline void beginRay(RayWalk& w, Point start, Point rayDir, double fishEye)
+{
+    //rayDir is unit length so sqrt(1 + (y/x)^2) is just 1/|x|. Axis aligned rays get a huge finite step
+    //instead of infinity so the crossing distances never work out 0 * inf
+    const double NEVER = 1e30;
+    w.start = start;
+    w.dir = rayDir;
+    w.fishEye = fishEye;
+    w.unit = { std::min(std::abs(1 / rayDir.x), NEVER), std::min(std::abs(1 / rayDir.y), NEVER) };
+    w.startCell = w.mapCheck = { floor(start.x), floor(start.y) };
+    w.step.x = (rayDir.x < 0) ? -1 : 1;
+    w.step.y = (rayDir.y < 0) ? -1 : 1;
+    w.first.x = ((rayDir.x < 0) ? start.x - w.mapCheck.x : w.mapCheck.x + 1 - start.x) * w.unit.x;
+    w.first.y = ((rayDir.y < 0) ? start.y - w.mapCheck.y : w.mapCheck.y + 1 - start.y) * w.unit.y;
+    w.crossingsX = w.crossingsY = 0;
+    w.distance = 0;
+    w.side = 0;
+}
+
+//Everything within r - 1 cells of the current one is open, so take every crossing up to the one that leaves
+//that square in one go. Same order as stepping, x crossings go first only when strictly closer
+static inline void skipOpenSquare(const Map& grid, RayWalk& w, Uint64* cellSteps)
+{
+    const int r = grid.skipAt(w.mapCheck.x, w.mapCheck.y);
+    if (r < 2) return;
+    const int cx = static_cast<int>(w.crossingsX), cy = static_cast<int>(w.crossingsY);
+    const double exitX = w.crossingX(cx + r - 1);
+    const double exitY = w.crossingY(cy + r - 1);
+    int nx, ny;
+    if (exitX < exitY)
     {
-        step.x = -1;
-        rayLength.x = (start.x - mapCheck.x) * rayUnitStepSize.x;
+        nx = cx + r - 1;
+        //y crossings at or before the x exit
+        ny = std::max(cy, static_cast<int>((exitX - w.first.y) / w.unit.y));
+        while (ny > cy && w.crossingY(ny - 1) > exitX) ny--;
+        while (w.crossingY(ny) <= exitX) ny++;
     }
     else
     {
-        step.x = 1;
-        rayLength.x = (mapCheck.x + 1 - start.x) * rayUnitStepSize.x;
-    } 
-    if (rayDir.y < 0) 
+        ny = cy + r - 1;
+        nx = std::max(cx, static_cast<int>((exitY - w.first.x) / w.unit.x));
+        while (nx > cx && w.crossingX(nx - 1) >= exitY) nx--;
+        while (w.crossingX(nx) < exitY) nx++;
+    }
+    w.crossingsX = nx;
+    w.crossingsY = ny;
+    w.mapCheck = { w.startCell.x + nx * w.step.x, w.startCell.y + ny * w.step.y };
+    w.distance = std::max(nx ? w.crossingX(nx - 1) : 0.0, ny ? w.crossingY(ny - 1) : 0.0);
+    if (cellSteps) (*cellSteps)++;
+}
+
+//Looks at the cell the ray just stepped into. Returns true once the ray is done, with the result in hit
+static inline bool visitCell(const Map& grid, RayWalk& w, bool skipping, CollisionEvent& hit, Uint64* cellSteps)
+{
+    if (!grid.inBounds(w.mapCheck.x, w.mapCheck.y))
     {
-        step.y = -1;
-        rayLength.y = (start.y - mapCheck.y) * rayUnitStepSize.y;
+        hit = CollisionEvent(); //invalid
+        return true;
     }
-    else 
+    const Cell& cell = grid.cellAt(w.mapCheck.x, w.mapCheck.y);
+    if (cell.wall)
     {
-        step.y = 1;
-        rayLength.y = (mapCheck.y + 1 - start.y) * rayUnitStepSize.y;
+        hit = {true, w.start + w.dir * w.distance, w.side, w.distance * w.fishEye, cell.wall};
+        return true;
     }
-    bool tileFound = false;
-    int maxDistance = (map->xSize() > map->ySize()) ? map->xSize() : map->ySize();
-    double distance = 0;
-    int side;
-    while (!tileFound && distance < maxDistance)
+    else if ((cell.flags & CELL_DOOR) && grid.doorAt(cell.door).exists)
+    {
+        //if it's a door we need to register a hit at a different point to render a thin wall and provide animation
+        const Door& door = grid.doorAt(cell.door);
+        double doorProgress = door.doorProgress;
+        Point intersection = w.start + w.dir * w.distance;
+        if (door.orientation) //horiz
+        {
+            if (intersection.x >= w.mapCheck.x + 0.0001 && intersection.x <= w.mapCheck.x - 0.0001 + doorProgress) //rounding error sigh
+            {
+                hit = {2, intersection, w.side, w.distance * w.fishEye, door.texIndex, doorProgress};
+                return true;
+            }
+        }
+        else //vert
+        {
+            if (intersection.y >= w.mapCheck.y + 0.0001 && intersection.y <= w.mapCheck.y - 0.0001 + doorProgress)
+            {
+                hit = {2, intersection, w.side, w.distance * w.fishEye, door.texIndex, doorProgress};
+                return true;
+            }
+        }
+    }
+    if (skipping) skipOpenSquare(grid, w, cellSteps);
+    return false;
+}
+
+//Steps one ray until it hits something or runs out of map
+static inline CollisionEvent walkRay(const Map& grid, RayWalk& w, bool skipping, Uint64* cellSteps)
+{
+    const int maxDistance = (grid.xSize() > grid.ySize()) ? grid.xSize() : grid.ySize();
+    CollisionEvent hit;
+    while (w.distance < maxDistance)
     {
-        if (rayLength.x < rayLength.y)
+        if (w.crossingX(w.crossingsX) < w.crossingY(w.crossingsY))
         {
-            mapCheck.x += step.x;
-            distance = rayLength.x;
-            rayLength.x += rayUnitStepSize.x;
-            side = 0;
+            w.mapCheck.x += w.step.x;
+            w.distance = w.crossingX(w.crossingsX++);
+            w.side = 0;
         }
         else
         {
-            mapCheck.y += step.y;
-            distance = rayLength.y;
-            rayLength.y += rayUnitStepSize.y;
-            side = 1;
+            w.mapCheck.y += w.step.y;
+            w.distance = w.crossingY(w.crossingsY++);
+            w.side = 1;
         }
-        if (mapCheck.x >= 0 && mapCheck.x < map->xSize() && mapCheck.y >= 0 && mapCheck.y < map->ySize())
+        if (cellSteps) (*cellSteps)++;
+        if (visitCell(grid, w, skipping, hit, cellSteps)) return hit;
+    }
+    return CollisionEvent(); //invalid
+}
+
+//Simple DDA, jumps across open space using the map's skip field when emptySpaceSkipping is on
+inline CollisionEvent GridGame::ddaRaycast(Point start, Point rayDir, double fishEye, Uint64* cellSteps) const
+{
+    const Map& grid = *map; //read only, this runs on the render workers
+    RayWalk w;
+    beginRay(w, start, rayDir, fishEye);
+    if (emptySpaceSkipping && grid.inBounds(w.mapCheck.x, w.mapCheck.y)) skipOpenSquare(grid, w, cellSteps);
+    return walkRay(grid, w, emptySpaceSkipping, cellSteps);
+}
+
+//Packet version of the DDA above. The lanes pick their next crossing with compares and blends instead of a branch,
+//each lane's new cell is then checked on its own and finished lanes drop out of the mask. Once a single lane is
+//left there is nothing to share so it finishes on the scalar walk. Every lane does exactly what ddaRaycast would
+void GridGame::ddaRaycastPacket(Point start, const Point* rayDirs, const double* fishEye, CollisionEvent* hits, Uint64* cellSteps) const
+{
+    const Map& grid = *map;
+    const bool skipping = emptySpaceSkipping;
+    RayWalk w[nva::RAY_PACKET];
+    for (int l = 0; l < nva::RAY_PACKET; l++)
+    {
+        beginRay(w[l], start, rayDirs[l], fishEye[l]);
+        if (skipping && grid.inBounds(w[l].mapCheck.x, w[l].mapCheck.y)) skipOpenSquare(grid, w[l], cellSteps);
+    }
+    unsigned active = (1u << nva::RAY_PACKET) - 1;
+#ifdef __SSE2__
+    const double maxDistance = (grid.xSize() > grid.ySize()) ? grid.xSize() : grid.ySize();
+    //structure of arrays copy of the lane state, two lanes per register
+    alignas(16) double firstX[nva::RAY_PACKET], firstY[nva::RAY_PACKET], unitX[nva::RAY_PACKET], unitY[nva::RAY_PACKET];
+    alignas(16) double stepX[nva::RAY_PACKET], stepY[nva::RAY_PACKET], nX[nva::RAY_PACKET], nY[nva::RAY_PACKET];
+    alignas(16) double cellX[nva::RAY_PACKET], cellY[nva::RAY_PACKET], dist[nva::RAY_PACKET];
+    auto load = [&](int l) {
+        nX[l] = w[l].crossingsX;
+        nY[l] = w[l].crossingsY;
+        cellX[l] = w[l].mapCheck.x;
+        cellY[l] = w[l].mapCheck.y;
+        dist[l] = w[l].distance;
+    };
+    auto store = [&](int l) {
+        w[l].crossingsX = nX[l];
+        w[l].crossingsY = nY[l];
+        w[l].mapCheck = { cellX[l], cellY[l] };
+        w[l].distance = dist[l];
+    };
+    for (int l = 0; l < nva::RAY_PACKET; l++)
+    {
+        firstX[l] = w[l].first.x;
+        firstY[l] = w[l].first.y;
+        unitX[l] = w[l].unit.x;
+        unitY[l] = w[l].unit.y;
+        stepX[l] = w[l].step.x;
+        stepY[l] = w[l].step.y;
+        load(l);
+        //same test the scalar loop makes before every step
+        if (w[l].distance >= maxDistance)
+        {
+            hits[l] = CollisionEvent();
+            active &= ~(1u << l);
+        }
+    }
+    const __m128d one = _mm_set1_pd(1.0);
+    while (active & (active - 1)) //two or more lanes still going
+    {
+        unsigned takeX = 0;
+        for (int p = 0; p < nva::RAY_PACKET; p += 2)
         {
-            if (map->getTileAt(mapCheck.x, mapCheck.y))
+            const __m128d nx = _mm_load_pd(nX + p), ny = _mm_load_pd(nY + p);
+            const __m128d cx = _mm_add_pd(_mm_load_pd(firstX + p), _mm_mul_pd(nx, _mm_load_pd(unitX + p)));
+            const __m128d cy = _mm_add_pd(_mm_load_pd(firstY + p), _mm_mul_pd(ny, _mm_load_pd(unitY + p)));
+            const __m128d x = _mm_cmplt_pd(cx, cy);
+            _mm_store_pd(nX + p, _mm_add_pd(nx, _mm_and_pd(x, one)));
+            _mm_store_pd(nY + p, _mm_add_pd(ny, _mm_andnot_pd(x, one)));
+            _mm_store_pd(cellX + p, _mm_add_pd(_mm_load_pd(cellX + p), _mm_and_pd(x, _mm_load_pd(stepX + p))));
+            _mm_store_pd(cellY + p, _mm_add_pd(_mm_load_pd(cellY + p), _mm_andnot_pd(x, _mm_load_pd(stepY + p))));
+            _mm_store_pd(dist + p, _mm_or_pd(_mm_and_pd(x, cx), _mm_andnot_pd(x, cy)));
+            takeX |= static_cast<unsigned>(_mm_movemask_pd(x)) << p;
+        }
+        for (int l = 0; l < nva::RAY_PACKET; l++)
+        {
+            if (!(active & (1u << l))) continue;
+            if (cellSteps) (*cellSteps)++;
+            //plain open cell with nothing to skip, the lane state can stay in the arrays
+            const int x = static_cast<int>(cellX[l]), y = static_cast<int>(cellY[l]);
+            if (grid.inBounds(x, y) && dist[l] < maxDistance)
             {
-                return {true, start + rayDir * distance, side, distance * cos(angleRadians - getAngle()*M_PI/180), map->getTileAt(mapCheck.x, mapCheck.y)}; //code fixes fish eye effect
+                const Cell& cell = grid.cellAt(x, y);
+                if (!cell.wall && !(cell.flags & CELL_DOOR) && (!skipping || grid.skipAt(x, y) < 2)) continue;
             }
-            else if (map->getDoorTileAt(mapCheck.x, mapCheck.y).exists)
+            store(l);
+            w[l].side = (takeX & (1u << l)) ? 0 : 1;
+            if (visitCell(grid, w[l], skipping, hits[l], cellSteps)) active &= ~(1u << l);
+            else if (w[l].distance >= maxDistance)
             {
-                //if it's a door we need to register a hit at a different point to render a thin wall and provide animation
-                double doorProgress = map->getDoorTileAt(mapCheck.x, mapCheck.y).doorProgress;
-                Point intersection = start + rayDir * distance;
-                if (map->getDoorTileAt(mapCheck.x, mapCheck.y).orientation) //horiz
-                {
-                    if (intersection.x >= mapCheck.x + 0.0001 && intersection.x <= mapCheck.x - 0.0001 + doorProgress) //rounding error sigh
-                    {
-                        return {2, start + rayDir * distance, side, distance * cos(angleRadians - getAngle()*M_PI/180), map->getDoorTileAt(mapCheck.x, mapCheck.y).texIndex, map->getDoorTileAt(mapCheck.x, mapCheck.y).doorProgress}; 
-                    }
-                }
-                else //vert
-                {
-                    if (intersection.y >= mapCheck.y + 0.0001 && intersection.y <= mapCheck.y - 0.0001 + doorProgress)
-                    {
-                        return {2, start + rayDir * distance, side, distance * cos(angleRadians - getAngle()*M_PI/180), map->getDoorTileAt(mapCheck.x, mapCheck.y).texIndex, map->getDoorTileAt(mapCheck.x, mapCheck.y).doorProgress}; 
-                    }
-                }
+                hits[l] = CollisionEvent();
+                active &= ~(1u << l);
             }
+            else load(l); //a skip may have moved it
         }
-        else return CollisionEvent(); //invalid
     }
-    return CollisionEvent(); //invalid
+    //hand whatever is left to the scalar walk below with its state up to date
+    for (int l = 0; l < nva::RAY_PACKET; l++)
+        if (active & (1u << l)) store(l);
+#endif
+    for (int l = 0; l < nva::RAY_PACKET; l++)
+        if (active & (1u << l)) hits[l] = walkRay(grid, w[l], skipping, cellSteps);
 }
 
 void GridGame::setPlayerPos(Point p)
@@ -257,78 +516,282 @@ void GridGame::pseudo3dRender(int FOV, double wallheight)
 
 
 int GridGame::shoot(Point p, double a) {
-    CollisionEvent e = ddaRaycast(p, a);
-    std::vector<std::pair<double, int>> distIndexVec;
-
     a = fmod(a, 360);
     a *= M_PI / 180;
-    double xcom = cos(a) * 0.01;
-    double ycom = sin(a) * 0.01;
+    return hitscan(p, { cos(a), sin(a) }, nva::SHOT_RANGE);
+}
+
+//Distance along a unit ray to where it enters a circle, 0 when it starts inside. False if it misses
+static inline bool rayCircle(Point start, Point dir, Point centre, double radius, double& t)
+{
+    const double ox = start.x - centre.x, oy = start.y - centre.y;
+    const double c = ox * ox + oy * oy - radius * radius;
+    if (c <= 0)
+    {
+        t = 0;
+        return true;
+    }
+    const double b = ox * dir.x + oy * dir.y;
+    const double disc = b * b - c;
+    if (b > 0 || disc < 0) return false; //pointing away or passing by
+    t = -b - sqrt(disc);
+    return true;
+}
 
-    auto entities = map->getEntities()->getEntityVec();
-    double RANGE = 1000;
-    Point check;
+//Steps the same cells ddaRaycast would (without skipping, the skip field doesn't know about entities). An entity
+//is filed under every cell its circle touches, so the cell a hit lands in lists it and once the ray's next cell
+//starts further out than the nearest hit nothing later can beat it
+int GridGame::hitscan(Point start, Point dir, double range, double* distance) const
+{
+    const Map& grid = *map;
+    const EntityHandler* ents = map->getEntities();
+    double nearest = range;
+    int hitID = -1;
+    auto testCell = [&](int x, int y) {
+        const std::vector<Entity*>* list = ents ? ents->entitiesIn(x, y) : nullptr;
+        if (!list) return;
+        for (const Entity* e : *list)
+        {
+            double t;
+            if (rayCircle(start, dir, e->pos, e->radius, t) && t < nearest)
+            {
+                nearest = t;
+                hitID = e->ID;
+            }
+        }
+    };
+    RayWalk w;
+    beginRay(w, start, dir, 1);
+    if (grid.inBounds(w.mapCheck.x, w.mapCheck.y)) testCell(w.mapCheck.x, w.mapCheck.y);
+    CollisionEvent wall;
+    while (w.distance < nearest)
+    {
+        if (w.crossingX(w.crossingsX) < w.crossingY(w.crossingsY))
+        {
+            w.mapCheck.x += w.step.x;
+            w.distance = w.crossingX(w.crossingsX++);
+            w.side = 0;
+        }
+        else
+        {
+            w.mapCheck.y += w.step.y;
+            w.distance = w.crossingY(w.crossingsY++);
+            w.side = 1;
+        }
+        if (w.distance >= nearest) break;
+        if (visitCell(grid, w, false, wall, nullptr))
+        {
+            if (!wall.hit) break; //left the map
+            if (wall.perpWallDist <= nearest)
+            {
+                //anything found so far is behind it, only the part of this cell in front of a door still counts
+                nearest = wall.perpWallDist;
+                hitID = -1;
+            }
+            testCell(w.mapCheck.x, w.mapCheck.y);
+            break;
+        }
+        testCell(w.mapCheck.x, w.mapCheck.y);
+    }
+    if (distance) *distance = (hitID >= 0) ? nearest : -1;
+    return hitID;
+}
 
-    for (Entity* entity : entities) 
+//Same walk as ddaRaycast, skip field included, but it stops at the far end of the segment
+static SightResult traceSight(const Map& grid, const SightQuery& q, bool skipping)
+{
+    SightResult result;
+    const Point delta = { q.to.x - q.from.x, q.to.y - q.from.y };
+    const double length = hypot(delta.x, delta.y);
+    result.distance = length;
+    result.visible = true;
+    if (length == 0) return result;
+    RayWalk w;
+    beginRay(w, q.from, { delta.x / length, delta.y / length }, 1);
+    if (skipping && grid.inBounds(w.mapCheck.x, w.mapCheck.y)) skipOpenSquare(grid, w, nullptr);
+    CollisionEvent hit;
+    while (w.distance < length)
     {
-        check = p;
-        double d = 0;
-        for (int i = 0; i < RANGE; ++i) 
+        if (w.crossingX(w.crossingsX) < w.crossingY(w.crossingsY))
         {
-            if (nva::checkCirc(entity->pos.x, entity->pos.y, entity->radius, check.x, check.y)) 
+            w.mapCheck.x += w.step.x;
+            w.distance = w.crossingX(w.crossingsX++);
+            w.side = 0;
+        }
+        else
+        {
+            w.mapCheck.y += w.step.y;
+            w.distance = w.crossingY(w.crossingsY++);
+            w.side = 1;
+        }
+        if (w.distance >= length) break;
+        if (visitCell(grid, w, skipping, hit, nullptr))
+        {
+            if (hit.hit && hit.perpWallDist < length)
             {
-                distIndexVec.push_back(std::make_pair(d, entity->ID));
-                break;
+                result.visible = false;
+                result.distance = hit.perpWallDist;
             }
-            check.x += xcom;
-            check.y += ycom;
-            d += hypot(xcom, ycom);
+            break;
         }
     }
-    if (distIndexVec.empty()) return -1;
-    std::sort(distIndexVec.begin(), distIndexVec.end());
-    if (distIndexVec.front().first < e.perpWallDist)
-        return distIndexVec.front().second;
+    return result;
+}
+
+void GridGame::lineOfSight(const std::vector<SightQuery>& queries, std::vector<SightResult>& results) const
+{
+    results.resize(queries.size());
+    if (queries.empty()) return;
+    const Map& grid = *map;
+    const bool skipping = emptySpaceSkipping;
+    const int count = static_cast<int>(queries.size());
+    const int jobs = (count + nva::SIGHT_PER_JOB - 1) / nva::SIGHT_PER_JOB;
+    renderPool->parallelFor(jobs, [&](int job, int)
+    {
+        const int end = std::min(count, (job + 1) * nva::SIGHT_PER_JOB);
+        for (int i = job * nva::SIGHT_PER_JOB; i < end; i++)
+            results[i] = traceSight(grid, queries[i], skipping);
+    });
+}
+
+//Per column ray offsets for a half FOV (degrees) and render size.
+//Column i looks FOV * atan(opp / adj) degrees away from the view direction
+void CameraProjection::build(int fov, int w, int h)
+{
+    FOV = fov;
+    width = w;
+    height = h;
+    adj = width / tan(FOV * M_PI / 180);
+    cosOffset.resize(width);
+    sinOffset.resize(width);
+    tanOffset.resize(width);
+    for (int i = 0; i < width; i++)
+    {
+        double opp = i - width / 2.0;
+        double offset = FOV * atan(opp / adj) * M_PI / 180;
+        cosOffset[i] = cos(offset);
+        sinOffset[i] = sin(offset);
+        tanOffset[i] = tan(offset);
+    }
+    planeStep = (width > 1) ? tanOffset[width / 2] - tanOffset[width / 2 - 1] : 1;
+    //floor rows are counted from 1, anything at or above the horizon never sees the floor
+    rowDistance.assign(height + 1, 0);
+    for (int y = height / 2 + 1; y <= height; y++) rowDistance[y] = height / (2.0 * y - height);
+}
 
-    return -1;
+//Inverse of the column mapping, returns false when the angle can't land on the projection plane
+bool CameraProjection::screenXForAngle(double relativeAngle, double& screenX) const
+{
+    relativeAngle = fmod(relativeAngle + 540.0, 360.0) - 180.0; //-180 to 180
+    double scan = relativeAngle / FOV;
+    if (std::abs(scan) >= M_PI / 2 - 0.001) return false;
+    screenX = adj * tan(scan) + width / 2.0;
+    return true;
 }
 
+//Splits the columns into chunks of roughly equal cost using the per column timings from last frame.
+//There are more chunks than workers so whoever finishes early just grabs the next one.
+void GridGame::balanceColumns(int columns)
+{
+    if (static_cast<int>(columnCost.size()) != columns) columnCost.assign(columns, 1);
+    const int chunks = std::min(columns, renderPool->size() * nva::CHUNKS_PER_WORKER);
+    double total = 0;
+    for (Uint64 c : columnCost) total += c;
+    chunkStarts.clear();
+    chunkStarts.push_back(0);
+    double acc = 0;
+    for (int i = 0; i < columns - 1; i++)
+    {
+        acc += columnCost[i];
+        if (acc * chunks >= total * chunkStarts.size() && static_cast<int>(chunkStarts.size()) < chunks)
+            chunkStarts.push_back(i + 1);
+    }
+    chunkStarts.push_back(columns);
+}
 
-//speed could almost certainly be improved with multithreading or decreasing # of raycasts
+//wall and floor casting is split across the render pool, sprites and UI stay on the calling thread
 void GridGame::pseudo3dRenderTextured(int FOV, double wallheight)
 {
-    // Calculate the render dimensions
-    const int renderWidth = INTERNAL_RENDER_RES_HORIZ;
-    const int renderHeight = INTERNAL_RENDER_RES_VERT;
-    double ZBuffer[renderWidth]; // store Z distances for sprite rendering (necessary for occlusion)
+    Uint64 frameStart = SDL_GetPerformanceCounter();
+    stats = RenderStats();
+    map->streamAround(playerPos); //page in around the player and wherever last frame's rays ran out of map
+    currentTextureSet->update(); //same for textures last frame sampled
+    if (headless)
+    {
+        //caller owns the framebuffer, SDL_Renderer and SDL_Window are never touched
+        renderScene(headlessTarget, FOV, wallheight);
+        Uint64 overlayStart = SDL_GetPerformanceCounter();
+        if (hudEnabled) compositeHud(headlessTarget);
+        stats.stageMs[STAGE_GUN_OVERLAY] = nva::ticksToMs(SDL_GetPerformanceCounter() - overlayStart);
+        stats.frameMs = nva::ticksToMs(SDL_GetPerformanceCounter() - frameStart);
+        lastStats = stats;
+        return;
+    }
     if (textureBuffer == nullptr)
-        textureBuffer = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_STREAMING, renderWidth, renderHeight);
-    std::vector<std::thread> threads;
-    const int sectionWidth = renderWidth / nva::MAX_THREADS;
-    int startX = 0;
-    Uint32* pixels;
-    int pitch;
-    SDL_LockTexture(textureBuffer, nullptr, reinterpret_cast<void**>(&pixels), &pitch);
-    Uint8 rshift = format->Rshift;
-    Uint8 gshift = format->Gshift;
-    Uint8 bshift = format->Bshift;
-    Uint8 ashift = format->Ashift;
+        textureBuffer = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_STREAMING, INTERNAL_RENDER_RES_HORIZ, INTERNAL_RENDER_RES_VERT);
+    RenderTarget target;
+    target.width = INTERNAL_RENDER_RES_HORIZ;
+    target.height = INTERNAL_RENDER_RES_VERT;
+    SDL_LockTexture(textureBuffer, nullptr, reinterpret_cast<void**>(&target.pixels), &target.pitch);
+    renderScene(target, FOV, wallheight);
+    presentFrame();
+    stats.frameMs = nva::ticksToMs(SDL_GetPerformanceCounter() - frameStart);
+    lastStats = stats;
+}
+
+//Casts walls, floors, ceilings and sprites into the target
+void GridGame::renderScene(const RenderTarget& target, int FOV, double wallheight)
+{
+    // Calculate the render dimensions
+    const int renderWidth = target.width;
+    const int renderHeight = target.height;
+    const int stride = target.pitch / sizeof(Uint32); //pixels per row, may be wider than the render width
+    Uint32* pixels = target.pixels;
+    zBuffer.resize(renderWidth); // store Z distances for sprite rendering (necessary for occlusion)
+    floorStart.resize(renderWidth);
+    double* ZBuffer = zBuffer.data();
     FOV /= 2;
+    if (!projection.matches(FOV, renderWidth, renderHeight)) projection.build(FOV, renderWidth, renderHeight);
+    const Point viewDir = { cos(angle * M_PI / 180), sin(angle * M_PI / 180) };
+    //the cast phase only gets read only views, nothing in here may change the map or textures
+    const Map& grid = *map;
+    const TextureHandler& texSet = *currentTextureSet;
+    const Point pos = playerPos;
+    const double skyAngle = (angle < 0) ? angle + 360 : angle;
+    const Uint32 black = SDL_MapRGBA(format, 0, 0, 0, 255);
+    balanceColumns(renderWidth);
+    for (RenderScratch& scratch : renderScratch) scratch = RenderScratch();
+    Uint64 castStart = SDL_GetPerformanceCounter();
     //wall casting
-    for (int i = 0; i < nva::MAX_THREADS; i++)
-    {
-        int endX = (i == nva::MAX_THREADS - 1) ? renderWidth : startX + sectionWidth;
-        threads.push_back(std::thread([&]{
-            //std::mutex mtx;
-            //mtx.lock();
-            for (int i = startX; i < endX; i++)
-    {
-        //change scandir in order to fix the spherical distortion
-        //double scanDir = 2 * i / static_cast<double>(renderWidth) - 1; // -1 ---- 0 ---- 1 for the scan across the screen
-        double opp = i - renderWidth / 2.0;
-        double adj = renderWidth / (tan((FOV * M_PI / 180)));
-        double scanDir = atan(opp / adj); // Updated scanDir
-        CollisionEvent collision = ddaRaycast(getPlayerPos(), angle + FOV * scanDir);
+    renderPool->parallelFor(chunkStarts.size() - 1, [&](int chunk, int worker)
+    {
+        RenderScratch& scratch = renderScratch[worker];
+        const int chunkEnd = chunkStarts[chunk + 1];
+        for (int group = chunkStarts[chunk]; group < chunkEnd; group += nva::RAY_PACKET)
+        {
+        const int lanes = std::min(nva::RAY_PACKET, chunkEnd - group);
+        Uint64 groupStart = SDL_GetPerformanceCounter();
+        Point rayDirs[nva::RAY_PACKET];
+        CollisionEvent collisions[nva::RAY_PACKET];
+        for (int l = 0; l < lanes; l++)
+        {
+            const int i = group + l;
+            //rotate the cached column offset by the view direction instead of redoing the trig per column
+            rayDirs[l] = { viewDir.x * projection.cosOffset[i] - viewDir.y * projection.sinOffset[i],
+                           viewDir.y * projection.cosOffset[i] + viewDir.x * projection.sinOffset[i] };
+        }
+        if (packetRays && lanes == nva::RAY_PACKET)
+            ddaRaycastPacket(pos, rayDirs, &projection.cosOffset[group], collisions, &scratch.ddaSteps);
+        else
+            for (int l = 0; l < lanes; l++)
+                collisions[l] = ddaRaycast(pos, rayDirs[l], projection.cosOffset[group + l], &scratch.ddaSteps);
+        Uint64 ddaTicks = SDL_GetPerformanceCounter() - groupStart;
+        scratch.ddaTicks += ddaTicks;
+        for (int l = 0; l < lanes; l++)
+        {
+        const int i = group + l;
+        const CollisionEvent& collision = collisions[l];
+        Uint64 ddaDone = SDL_GetPerformanceCounter();
         //could probably change perpwalldist in order to get infinitely thin walls
         ZBuffer[i] = collision.perpWallDist; //set zbuffer value
         int lineHeight = static_cast<int>(wallheight * (renderHeight / collision.perpWallDist));
@@ -337,110 +800,156 @@ void GridGame::pseudo3dRenderTextured(int FOV, double wallheight)
         int drawEnd = lineHeight / 2 + renderHeight / 2;
         if (drawEnd > renderHeight) drawEnd = renderHeight;
         double texCoord;
-        const Uint32 black = SDL_MapRGBA(format, 0, 0, 0, 255);
         if (collision.sideHit)
             texCoord = collision.intersect.x - static_cast<int>(collision.intersect.x);
         else
             texCoord = collision.intersect.y - static_cast<int>(collision.intersect.y);
         int textureToRender = collision.tileData;
-        int texX = static_cast<int>(texCoord * currentTextureSet->widthHeightAt(textureToRender - 1).first);
-        texX = nva::clamp<int>(texX, 0, currentTextureSet->widthHeightAt(textureToRender - 1).first);
-        if (collision.hit == 2) // door we need to offset the texture according to the progress
-        {
-            texX = static_cast<int>((texCoord + (1 - collision.doorProgress)) * currentTextureSet->widthHeightAt(textureToRender - 1).first);
-            texX = nva::clamp<int>(texX, 0, currentTextureSet->widthHeightAt(textureToRender - 1).first);
-        }
-        
-        double lightVal = nva::BRIGHTNESS - map->getLightTileAt(collision.intersect.x + 0.0001, collision.intersect.y + 0.0001) * nva::BRIGHTNESS;
-        if (lightVal == 0) lightVal = 1;
-        if (textureToRender)
+        if (textureToRender > 0)
         {
+            //texels per screen pixel shrink with distance, sample the level that puts roughly one on each pixel
+            const double wallTexels = texSet.textureAt(textureToRender - 1).height / static_cast<double>(std::max(lineHeight, 1));
+            const Texture& wallTex = mipmapping ? texSet.mipFor(textureToRender - 1, wallTexels) : texSet.textureAt(textureToRender - 1);
+            if (collision.hit == 2) // door we need to offset the texture according to the progress
+                texCoord += 1 - collision.doorProgress;
+            int texX = static_cast<int>(texCoord * wallTex.width);
+            texX = nva::clamp<int>(texX, 0, wallTex.width - 1);
+            const Uint32* texels = wallTex.column(texX);
+            const Uint32 wallScale = shading.scaleAt(shading.level(grid.getLightTileAt(collision.intersect.x + 0.0001, collision.intersect.y + 0.0001), collision.perpWallDist));
             /*
             
                 Walls
 
             */
+            //gather the column, shade it in one pass, then write it out down the frame
+            const int span = drawEnd - drawStart;
+            if (static_cast<int>(scratch.column.size()) < span) scratch.column.resize(renderHeight);
+            Uint32* column = scratch.column.data();
             for (int y = drawStart; y < drawEnd; y++)
             {
-                int texY = (((y * 2 - renderHeight + lineHeight) * currentTextureSet->widthHeightAt(textureToRender - 1).second) / lineHeight) / 2;
-                texY = nva::clamp<int>(texY, 0, currentTextureSet->widthHeightAt(textureToRender - 1).second);
-                rgba textureColor;
-                textureColor = currentTextureSet->colorAt(textureToRender - 1, texX, texY);
-                pixels[y * renderWidth + i] = ((int)(textureColor.r / lightVal) << rshift) |
-                                                ((int)(textureColor.g / lightVal) << gshift) |
-                                                ((int)(textureColor.b / lightVal) << bshift) |
-                                                (textureColor.a << ashift);
-            }
-            //floor casting
-            for (int y = drawEnd + 1; y <= renderHeight; y++)
-            {
-                // Calculate the current distance from the player to the floor/ceiling
-                double currentDist = renderHeight / (2.0 * y - renderHeight);
-                double weight = currentDist / collision.perpWallDist;
-                double floorX = weight * collision.intersect.x + (1 - weight) * playerPos.x;
-                double floorY = weight * collision.intersect.y + (1 - weight) * playerPos.y;
-                int ceilTex = map->getCeilingTileAt(floorX, floorY);
-                int floorTex = map->getFloorTileAt(floorX, floorY);
-                double lightVal = nva::BRIGHTNESS - map->getLightTileAt(floorX, floorY) * nva::BRIGHTNESS;
-                if (lightVal == 0) lightVal = 1;
-                rgba ctex;
-                if (ceilTex == SKY)
-                {
-                    lightVal = 1;
-                    int cw = currentTextureSet->widthHeightAt(map->getSkyTexture()).first;
-                    int ch = currentTextureSet->widthHeightAt(map->getSkyTexture()).second;
-                    if (angle < 0) angle += 360;
-                    int skyOffset = static_cast<int>(angle * SKYSCALEFACTOR) % cw;
-                    int ceilTexX = (i + skyOffset) * (cw / renderWidth) % cw;
-                    int ceilTexY = y * (ch / renderHeight) % ch;
-                    ceilTexX = nva::clamp<int>(ceilTexX, 0, cw);
-                    ceilTexY = nva::clamp<int>(ceilTexY, 0, ch);
-                    ctex = currentTextureSet->colorAt(map->getSkyTexture(), ceilTexX, ceilTexY);
-                }
-                else
-                {
-                    int cw = currentTextureSet->widthHeightAt(ceilTex).first;
-                    int ch = currentTextureSet->widthHeightAt(ceilTex).second;
-                    int ceilTexX = static_cast<int>(floorX * cw) % cw;
-                    int ceilTexY = static_cast<int>(floorY * ch) % ch;
-                    ceilTexX = nva::clamp<int>(ceilTexX, 0, cw);
-                    ceilTexY = nva::clamp<int>(ceilTexY, 0, ch);
-                    ctex = currentTextureSet->colorAt(ceilTex, ceilTexX, ceilTexY);
-                }
-                int fw = currentTextureSet->widthHeightAt(floorTex).first;
-                int floorTexX = static_cast<int>(floorX * fw) % fw;
-                int fh = currentTextureSet->widthHeightAt(floorTex).second;
-                int floorTexY = static_cast<int>(floorY * fh) % fh;
-                floorTexX = nva::clamp<int>(floorTexX, 0, fw);
-                floorTexY = nva::clamp<int>(floorTexY, 0, fh);
-                rgba ftex = currentTextureSet->colorAt(floorTex, floorTexX, floorTexY);
-                pixels[(y-1) * renderWidth + i] = ((int)(ftex.r /lightVal) << rshift) | //floor
-                                                        ((int)(ftex.g / lightVal) << gshift) |
-                                                        ((int)(ftex.b / lightVal) << bshift) |
-                                                        (ftex.a << ashift);
-                pixels[(renderHeight - y) * renderWidth + i] = ((int)(ctex.r / lightVal) << rshift) | //ceiling
-                                                               ((int)(ctex.g / lightVal) << gshift) |
-                                                               ((int)(ctex.b / lightVal) << bshift) |
-                                                               (ctex.a << ashift);
+                int texY = (((y * 2 - renderHeight + lineHeight) * wallTex.height) / lineHeight) / 2;
+                texY = nva::clamp<int>(texY, 0, wallTex.height - 1);
+                column[y - drawStart] = texels[texY];
             }
+            ShadeTable::shadeSpan(column, column, span, wallScale);
+            for (int y = drawStart; y < drawEnd; y++)
+                pixels[y * stride + i] = column[y - drawStart];
+            scratch.wallTicks += SDL_GetPerformanceCounter() - ddaDone;
+            scratch.pixelsWritten += drawEnd - drawStart;
+            floorStart[i] = drawEnd; //floor and ceiling get filled in by the row pass below
         }
         else
         {
             for (int y = 0; y < renderHeight; y++)
             {
-                pixels[y * renderWidth + i] = black;
+                pixels[y * stride + i] = black;
             }
+            scratch.pixelsWritten += renderHeight;
+            floorStart[i] = renderHeight;
         }
-        
-    }
-        //mtx.unlock();
-        startX += sectionWidth;
-        }));
-    }
-    
-    for (auto& thread : threads)
+        //the group's cast time is split evenly between its columns
+        Uint64 columnTicks = SDL_GetPerformanceCounter() - ddaDone + ddaTicks / lanes;
+        columnCost[i] = columnTicks ? columnTicks : 1;
+        }
+        }
+    });
+    /*
+
+        Floor and ceiling casting, one screen row at a time. Every pixel in a row is the same distance away
+        so a row is just its distance and a step along the camera plane, and neighbouring pixels mostly share a cell
+
+    */
+    const Point planeDir = { -viewDir.y, viewDir.x };
+    const int firstRow = renderHeight / 2;
+    const int rowJobs = (renderHeight - firstRow + nva::ROWS_PER_JOB - 1) / nva::ROWS_PER_JOB;
+    renderPool->parallelFor(rowJobs, [&](int job, int worker)
+    {
+        RenderScratch& scratch = renderScratch[worker];
+        Uint64 rowsStart = SDL_GetPerformanceCounter();
+        //only touched once a sky cell shows up, so sky free views never load or pin the sky texture
+        const Texture* skyTex = nullptr;
+        int skyW = 0, skyH = 0, skyOffset = 0;
+        const int rowEnd = std::min(renderHeight, firstRow + (job + 1) * nva::ROWS_PER_JOB);
+        for (int row = firstRow + job * nva::ROWS_PER_JOB; row < rowEnd; row++)
+        {
+            const int y = row + 1; //rows are counted from 1 here so the ceiling mirrors the floor
+            const double rowDist = projection.rowDistance[y];
+            const Point base = { pos.x + rowDist * viewDir.x, pos.y + rowDist * viewDir.y };
+            const Point step = { rowDist * planeDir.x, rowDist * planeDir.y };
+            Uint32* floorRow = pixels + row * stride;
+            Uint32* ceilRow = pixels + (renderHeight - y) * stride;
+            //world units one pixel of this row covers, across the row or to the next row down, whichever is bigger
+            const double nextDist = (y < renderHeight) ? projection.rowDistance[y + 1] : rowDist;
+            const double footprint = mipmapping ? std::max(rowDist * projection.planeStep, rowDist - nextDist) : 0;
+            int lastCellX = -1, lastCellY = -1;
+            int ceilTex = 0, floorTex = -1, ceilMipTex = -1;
+            const Texture* ft = nullptr;
+            const Texture* ct = nullptr;
+            Uint32 floorScale = 256, ceilScale = 256;
+            for (int i = 0; i < renderWidth; i++)
+            {
+                if (row < floorStart[i]) continue; //wall covers this pixel
+                double floorX = base.x + step.x * projection.tanOffset[i];
+                double floorY = base.y + step.y * projection.tanOffset[i];
+                int cellX = static_cast<int>(floorX);
+                int cellY = static_cast<int>(floorY);
+                if (cellX != lastCellX || cellY != lastCellY)
+                {
+                    lastCellX = cellX;
+                    lastCellY = cellY;
+                    const Cell& cell = grid.cellAt(cellX, cellY);
+                    ceilTex = (cell.flags & CELL_SKY) ? SKY : cell.ceiling;
+                    if (ceilTex == SKY && !skyTex)
+                    {
+                        skyTex = &texSet.textureAt(grid.getSkyTexture());
+                        skyW = skyTex->width;
+                        skyH = skyTex->height;
+                        skyOffset = static_cast<int>(skyAngle * SKYSCALEFACTOR) % skyW;
+                    }
+                    //the level only depends on the texture within a row, so only look it up again when that changes
+                    if (cell.floor != floorTex)
+                    {
+                        floorTex = cell.floor;
+                        ft = &texSet.mipFor(floorTex, texSet.textureAt(floorTex).width * footprint);
+                    }
+                    if (ceilTex != SKY && ceilTex != ceilMipTex)
+                    {
+                        ceilMipTex = ceilTex;
+                        ct = &texSet.mipFor(ceilTex, texSet.textureAt(ceilTex).width * footprint);
+                    }
+                    //open sky lights the floor under it fully and is never shaded itself
+                    double light = (ceilTex == SKY) ? 1 : cell.light / 255.0;
+                    floorScale = shading.scaleAt(shading.level(light, rowDist));
+                    ceilScale = (ceilTex == SKY) ? 256 : floorScale;
+                }
+                Uint32 ctex;
+                if (ceilTex == SKY)
+                {
+                    int ceilTexX = (i + skyOffset) * (skyW / renderWidth) % skyW;
+                    int ceilTexY = y * (skyH / renderHeight) % skyH;
+                    ceilTexX = nva::clamp<int>(ceilTexX, 0, skyW - 1);
+                    ceilTexY = nva::clamp<int>(ceilTexY, 0, skyH - 1);
+                    ctex = skyTex->at(ceilTexX, ceilTexY);
+                }
+                else
+                    ctex = ct->at(ct->wrapX(static_cast<int>(floorX * ct->width)), ct->wrapY(static_cast<int>(floorY * ct->height)));
+                Uint32 ftex = ft->at(ft->wrapX(static_cast<int>(floorX * ft->width)), ft->wrapY(static_cast<int>(floorY * ft->height)));
+                floorRow[i] = ShadeTable::shade(ftex, floorScale);
+                ceilRow[i] = ShadeTable::shade(ctex, ceilScale);
+                scratch.pixelsWritten += 2;
+            }
+        }
+        scratch.floorTicks += SDL_GetPerformanceCounter() - rowsStart;
+    });
+    Uint64 castDone = SDL_GetPerformanceCounter();
+    stats.castMs = nva::ticksToMs(castDone - castStart);
+    for (const RenderScratch& scratch : renderScratch)
     {
-        thread.join();
+        stats.stageMs[STAGE_WALL_DDA] += nva::ticksToMs(scratch.ddaTicks);
+        stats.stageMs[STAGE_WALL_TEXTURE] += nva::ticksToMs(scratch.wallTicks);
+        stats.stageMs[STAGE_FLOOR_CEILING] += nva::ticksToMs(scratch.floorTicks);
+        stats.ddaSteps += scratch.ddaSteps;
+        stats.pixelsWritten += scratch.pixelsWritten;
     }
     /*
     
@@ -455,49 +964,23 @@ void GridGame::pseudo3dRenderTextured(int FOV, double wallheight)
     std::sort(temp.begin(), temp.end(), [this](Sprite *a, Sprite *b){
     return hypot(a->x - getPlayerPos().x, a->y - getPlayerPos().y) > hypot(b->x - getPlayerPos().x, b->y - getPlayerPos().y);
     });
+    Uint64 sortDone = SDL_GetPerformanceCounter();
+    stats.stageMs[STAGE_SPRITE_SORT] = nva::ticksToMs(sortDone - castDone);
 
     //rendering
-    
-/*
-double opp = i - renderWidth / 2.0;
-double adj = renderWidth / (tan((FOV * M_PI / 180)));
-double scanDir = atan(opp / adj); // Updated scanDir
-*/
-
-    double planeLength = tan((FOV) * M_PI / 180); 
-    double planeX = -sin(angle * M_PI / 180) * planeLength; 
-    double planeY = cos(angle * M_PI / 180) * planeLength;
+    const double cosAngle = cos(angle * M_PI / 180);
+    const double sinAngle = sin(angle * M_PI / 180);
     for (auto it = temp.begin(); it != temp.end(); it++)
     {
         double spriteX = (*it)->x - getPlayerPos().x;
         double spriteY = (*it)->y - getPlayerPos().y;
-        double invDet = 1.0 / (planeX * sin(angle * M_PI / 180) - cos(angle * M_PI / 180) * planeY);
-        //double transformX = invDet * (sin(angle * M_PI / 180) * spriteX - cos(angle * M_PI / 180) * spriteY);
-        double transformY = invDet * (-planeY * spriteX + planeX * spriteY);
-        //int spriteScreenX = int((static_cast<double>(renderWidth) / 2.0) * (1.0 + transformX / transformY));
-        // double spriteDir = atan2(spriteY, spriteX);
-        double aspect_ratio = static_cast<double>(renderWidth) / static_cast<double>(renderHeight);
-        // //int spriteScreenX = std::round(renderWidth / 2.0 + renderWidth * tan((spriteDir * 180 / M_PI - angle) * M_PI / 180) / (tan(FOV * M_PI / 180)));
-        // int spriteScreenX = std::round(renderWidth / aspect_ratio + (renderWidth) * tan((spriteDir * 180 / M_PI - (angle)) * M_PI / 180) / (tan(FOV * M_PI / 180)));
-        double spriteDir = atan2(spriteY, spriteX) * 180.0 / M_PI;
-        double relativeAngle = ((spriteDir) - angle);
-        
-        // Ensure the sprite is within the FOV range
-        //std::cout << relativeAngle << std::endl;
-        double distanceToProjectionPlane = (renderWidth / 2.0) / tan(FOV / 2.0 * M_PI / 180);
-        // Apply a fish-eye correction to the sprite positions
-        /*
-            The correction factor is arbitrary. Just did a lot of experimenting and found that it works well.
-            where does the 0.7777... come from? experimenting
-            But it might be 1 - aspect_ratio
-        */
-        double correctionFactor = ((0.7777777) * (52.5 / FOV)) / cos(relativeAngle * M_PI / 180); //Correction factor constant will need to change with FOV changes (FOV 105 when testing)
-        double correctedDistance = distanceToProjectionPlane * correctionFactor;
-        double spriteScreenX = round((correctedDistance * tan(relativeAngle * M_PI / 180)) + (renderWidth / 2.0));
-        
-        //std::cout << spriteDir << std::endl;
-        // Correct spriteScreenX for spherical distortion
-        //double spriteScreenX = spriteScreenXtemp;
+        //depth along the view direction, same fish eye corrected distance the walls use
+        double transformY = cosAngle * spriteX + sinAngle * spriteY;
+        double relativeAngle = atan2(spriteY, spriteX) * 180.0 / M_PI - angle;
+        //project through the same column mapping as the walls so sprites stay glued to the floor under them
+        double spriteScreenX = 0;
+        bool onPlane = projection.screenXForAngle(relativeAngle, spriteScreenX);
+        spriteScreenX = round(spriteScreenX);
         int spriteHeight = abs(int(renderHeight / transformY));
         int drawStartY = -spriteHeight / 2 + renderHeight / 2;
         if(drawStartY < 0) drawStartY = 0;
@@ -508,9 +991,9 @@ double scanDir = atan(opp / adj); // Updated scanDir
         if(drawStartX < 0) drawStartX = 0;
         int drawEndX = spriteWidth / 2 + spriteScreenX;
         if(drawEndX >= renderWidth) drawEndX = renderWidth - 1;
+        if (!onPlane) drawEndX = drawStartX; //still run the animation below, just don't draw it
         int texSelect = 0; //default
-        double lightVal = nva::BRIGHTNESS - map->getLightTileAt((*it)->x, (*it)->y) * nva::BRIGHTNESS;
-        if (lightVal == 0) lightVal = 1;
+        const Uint32 spriteScale = shading.scaleAt(shading.level(map->getLightTileAt((*it)->x, (*it)->y), transformY));
         if ((*it)->multiAngle && (*it)->animated)
         {
             const int numOrientations = 8; // Eight orientations
@@ -614,29 +1097,42 @@ double scanDir = atan(opp / adj); // Updated scanDir
 
         else texSelect = (*it)->texIndex;
         
+        const double spriteTexels = currentTextureSet->textureAt(texSelect).height / static_cast<double>(std::max(spriteHeight, 1));
+        const Texture& spriteTex = mipmapping ? currentTextureSet->mipFor(texSelect, spriteTexels) : currentTextureSet->textureAt(texSelect);
+        bool drawn = false;
         for(int stripe = drawStartX; stripe < drawEndX; stripe++)
         {
-            int texX = int(256 * (stripe - (-spriteWidth / 2 + spriteScreenX)) * currentTextureSet->widthHeightAt(texSelect).first / spriteWidth) / 256;
-            texX = nva::clamp<int>(texX, 0, currentTextureSet->widthHeightAt(texSelect).first);
+            int texX = int(256 * (stripe - (-spriteWidth / 2 + spriteScreenX)) * spriteTex.width / spriteWidth) / 256;
+            texX = nva::clamp<int>(texX, 0, spriteTex.width - 1);
+            const Uint32* texels = spriteTex.column(texX);
             if(transformY > 0 && stripe > 0 && stripe < renderWidth && transformY < ZBuffer[stripe])
             {
+                drawn = true;
                 for(int y = drawStartY; y < drawEndY; y++)
                 {
                     int d = (y - renderHeight / 2) * 256 + spriteHeight * 128;
-                    int texY = ((d * currentTextureSet->widthHeightAt(texSelect).second) / spriteHeight) / 256;
-                    texY = nva::clamp<int>(texY, 0, currentTextureSet->widthHeightAt(texSelect).second);
-                    rgba textureColor;
-                    textureColor = currentTextureSet->colorAt(texSelect, texX, texY);
-                    if(textureColor.a != 0) // If the pixel is not transparent
-                        pixels[y * renderWidth + stripe] =  ((int)(textureColor.r / lightVal) << rshift) |
-                                                            ((int)(textureColor.g / lightVal) << gshift) |
-                                                            ((int)(textureColor.b / lightVal) << bshift) |
-                                                            (textureColor.a << ashift);
+                    int texY = ((d * spriteTex.height) / spriteHeight) / 256;
+                    texY = nva::clamp<int>(texY, 0, spriteTex.height - 1);
+                    Uint32 texel = texels[texY];
+                    if(texel & 0xFF) // If the pixel is not transparent
+                    {
+                        pixels[y * stride + stripe] = ShadeTable::shade(texel, spriteScale);
+                        stats.pixelsWritten++;
+                    }
                 }
             }
         }
+        if (drawn) stats.spritesDrawn++;
     }
+    stats.stageMs[STAGE_SPRITE_DRAW] = nva::ticksToMs(SDL_GetPerformanceCounter() - sortDone);
+}
 
+//Scales the back buffer into the window, draws the UI on top and presents
+void GridGame::presentFrame()
+{
+    const int renderWidth = INTERNAL_RENDER_RES_HORIZ;
+    const int renderHeight = INTERNAL_RENDER_RES_VERT;
+    Uint64 uploadStart = SDL_GetPerformanceCounter();
     SDL_UnlockTexture(textureBuffer);
 
     // Calculate the target area to maintain aspect ratio
@@ -670,128 +1166,534 @@ double scanDir = atan(opp / adj); // Updated scanDir
 
     // Render the back buffer texture in the window
     SDL_RenderCopy(renderer, textureBuffer, nullptr, &targetRect);
+    Uint64 uploadDone = SDL_GetPerformanceCounter();
+    stats.stageMs[STAGE_TEXTURE_UPLOAD] = nva::ticksToMs(uploadDone - uploadStart);
     /*
     
             UI HERE DOWN THEN RENDER PRESENT
     
     */
+    if (!hudEnabled)
+    {
+        SDL_RenderPresent(renderer);
+        stats.stageMs[STAGE_PRESENT] = nva::ticksToMs(SDL_GetPerformanceCounter() - uploadDone);
+        return;
+    }
 
     //Render gun
-    const int GUNSCALE = 4;
-    std::vector<unsigned char> imageData = currentTextureSet->getLoadedTextures()[gunIndex];
-    std::pair<int, int> dimensions = currentTextureSet->widthHeightAt(gunIndex);
-    int32_t width = dimensions.first;
-    int32_t height = dimensions.second;
+    const Texture& gun = currentTextureSet->textureAt(gunIndex);
+    int32_t width = gun.width;
+    int32_t height = gun.height;
     int screenWidth, screenHeight;
     SDL_GetRendererOutputSize(renderer, &screenWidth, &screenHeight); 
     int x = (screenWidth - (width*GUNSCALE)) / 2; // Horizontal position for center alignment.
     int y = screenHeight - height*GUNSCALE; // Vertical position for bottom alignment.
     SDL_Rect dstrect = { x, y, width*GUNSCALE, height*GUNSCALE };
-    int32_t bytesPerPixel = imageData.size() / (width * height);
-    int32_t pit = width * bytesPerPixel;
-    pit = (pit + 3) & ~3; // Align the pitch to 4 bytes
-    int32_t Rmask = 0x000000FF;
-    int32_t Gmask = 0x0000FF00;
-    int32_t Bmask = 0x00FF0000;
-    int32_t Amask = (bytesPerPixel == 4) ? 0xFF000000 : 0;
-    auto cachedGunSurface = SDL_CreateRGBSurfaceFrom((imageData.data()), width, height, bytesPerPixel * 8, pit, Rmask, Gmask, Bmask, Amask);
-    auto cachedGunTex = SDL_CreateTextureFromSurface(renderer, cachedGunSurface);
-    SDL_RenderCopy(renderer, cachedGunTex, NULL, &dstrect);
-    SDL_FreeSurface(cachedGunSurface);
-    SDL_DestroyTexture(cachedGunTex);
-
-    SDL_Point point = {0, 0};
-    FOX_RenderText(font, (const Uint8*)"Health: 100", &point);
+    SDL_Texture* gunTexture = getOverlayTexture(gunIndex);
+    if (gunTexture) SDL_RenderCopy(renderer, gunTexture, NULL, &dstrect);
+    Uint64 overlayDone = SDL_GetPerformanceCounter();
+    stats.stageMs[STAGE_GUN_OVERLAY] = nva::ticksToMs(overlayDone - uploadDone);
+
+    updateStatsOverlay();
+    if (font) hud.draw(renderer, font);
+    Uint64 textDone = SDL_GetPerformanceCounter();
+    stats.stageMs[STAGE_HUD_TEXT] = nva::ticksToMs(textDone - overlayDone);
 
     // Present the rendered frame
     SDL_RenderPresent(renderer);
+    stats.stageMs[STAGE_PRESENT] = nva::ticksToMs(SDL_GetPerformanceCounter() - textDone);
+}
+
+//Puts last frame's stats in the top left corner under the health text, refreshed a few times a second
+void GridGame::updateStatsOverlay()
+{
+    if (!statsOverlay)
+    {
+        for (int l : statsLines) hud.setText(l, "");
+        return;
+    }
+    Uint64 now = SDL_GetPerformanceCounter();
+    if (!statsLines.empty() && nva::ticksToMs(now - lastStatsRefresh) < STATS_REFRESH_MS) return;
+    lastStatsRefresh = now;
+    const RenderStats& shown = lastStats;
+    std::vector<std::string> lines;
+    char line[64];
+    snprintf(line, sizeof(line), "frame %.2f ms  cast %.2f ms", shown.frameMs, shown.castMs);
+    lines.push_back(line);
+    for (int i = 0; i < STAGE_COUNT; i++)
+    {
+        snprintf(line, sizeof(line), "%s %.2f ms", RenderStats::stageName(i), shown.stageMs[i]);
+        lines.push_back(line);
+    }
+    snprintf(line, sizeof(line), "dda steps %llu", static_cast<unsigned long long>(shown.ddaSteps));
+    lines.push_back(line);
+    snprintf(line, sizeof(line), "pixels %llu", static_cast<unsigned long long>(shown.pixelsWritten));
+    lines.push_back(line);
+    snprintf(line, sizeof(line), "sprites %d", shown.spritesDrawn);
+    lines.push_back(line);
+    const int LINE_HEIGHT = 25;
+    while (statsLines.size() < lines.size())
+        statsLines.push_back(hud.addLine({0, LINE_HEIGHT * static_cast<int>(statsLines.size() + 1)}));
+    for (size_t i = 0; i < lines.size(); i++) hud.setText(statsLines[i], lines[i]);
+}
+
+HudText::~HudText()
+{
+    if (layer) SDL_DestroyTexture(layer);
+}
+
+int HudText::addLine(SDL_Point pos, const std::string& text)
+{
+    Line l;
+    l.pos = pos;
+    l.text = text;
+    lines.push_back(l);
+    dirty = true;
+    return lines.size() - 1;
+}
+
+void HudText::setText(int line, const std::string& text)
+{
+    Line& l = lines[line];
+    l.hasValue = false;
+    if (l.text == text) return;
+    l.text = text;
+    dirty = true;
+}
+
+void HudText::setValue(int line, const std::string& label, int value)
+{
+    Line& l = lines[line];
+    if (l.hasValue && l.value == value && l.label == label) return;
+    l.hasValue = true;
+    l.value = value;
+    l.label = label;
+    l.text = label + std::to_string(value);
+    dirty = true;
+}
+
+void HudText::draw(SDL_Renderer* renderer, FOX_Font* font)
+{
+    int w, h;
+    SDL_GetRendererOutputSize(renderer, &w, &h);
+    if (!layer || w != layerW || h != layerH)
+    {
+        if (layer) SDL_DestroyTexture(layer);
+        layer = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_TARGET, w, h);
+        if (!layer) return;
+        SDL_SetTextureBlendMode(layer, SDL_BLENDMODE_BLEND);
+        layerW = w;
+        layerH = h;
+        dirty = true;
+    }
+    if (dirty)
+    {
+        SDL_Texture* previous = SDL_GetRenderTarget(renderer);
+        SDL_SetRenderTarget(renderer, layer);
+        SDL_SetRenderDrawColor(renderer, 0, 0, 0, 0);
+        SDL_RenderClear(renderer);
+        for (const Line& l : lines)
+        {
+            if (l.text.empty()) continue;
+            SDL_Point point = l.pos;
+            FOX_RenderText(font, (const Uint8*)l.text.c_str(), &point);
+        }
+        SDL_SetRenderTarget(renderer, previous);
+        dirty = false;
+        rebuilds++;
+    }
+    SDL_RenderCopy(renderer, layer, nullptr, nullptr);
+}
+
+const char* RenderStats::stageName(int stage)
+{
+    static const char* names[STAGE_COUNT] = {"wall dda", "wall texture", "floor/ceiling", "sprite sort", "sprite draw", "texture upload", "gun overlay", "hud text", "present"};
+    return (stage >= 0 && stage < STAGE_COUNT) ? names[stage] : "unknown";
+}
+
+ShadeTable::ShadeTable()
+{
+    for (int k = 0; k < nva::SHADE_LEVELS; k++)
+        scale[k] = static_cast<Uint32>(round(256.0 * (nva::SHADE_LEVELS - 1 - k) / (nva::SHADE_LEVELS - 1)));
+}
+
+int ShadeTable::level(double light, double distance) const
+{
+    //same divisor the lightmap always used, but never below 1 so bright tiles can't overflow a channel
+    double divisor = std::max(1.0, nva::BRIGHTNESS - light * nva::BRIGHTNESS);
+    if (fogDensity > 0) divisor *= 1 + fogDensity * std::max(0.0, distance);
+    int l = static_cast<int>(round((1 - 1 / divisor) * (nva::SHADE_LEVELS - 1)));
+    return nva::clamp<int>(l, 0, nva::SHADE_LEVELS - 1);
+}
+
+void ShadeTable::shadeSpan(Uint32* dst, const Uint32* src, int n, Uint32 scale)
+{
+    for (int i = 0; i < n; i++)
+        dst[i] = shade(src[i], scale);
+}
+
+//Software version of the HUD for headless targets. Only the gun is drawn since text needs a renderer
+void GridGame::compositeHud(const RenderTarget& target)
+{
+    const int stride = target.pitch / sizeof(Uint32);
+    int width = currentTextureSet->widthHeightAt(gunIndex).first;
+    int height = currentTextureSet->widthHeightAt(gunIndex).second;
+    //same size relative to the frame as the gun drawn over the window
+    double scale = static_cast<double>(GUNSCALE) * target.width / SCREEN_WIDTH;
+    int drawWidth = static_cast<int>(width * scale);
+    int drawHeight = static_cast<int>(height * scale);
+    if (drawWidth <= 0 || drawHeight <= 0) return;
+    int startX = (target.width - drawWidth) / 2;
+    int startY = target.height - drawHeight;
+    for (int y = std::max(startY, 0); y < target.height; y++)
+    {
+        int texY = nva::clamp<int>((y - startY) * height / drawHeight, 0, height - 1);
+        for (int x = std::max(startX, 0); x < std::min(startX + drawWidth, target.width); x++)
+        {
+            int texX = nva::clamp<int>((x - startX) * width / drawWidth, 0, width - 1);
+            Uint32 texel = currentTextureSet->pixelAt(gunIndex, texX, texY);
+            if (texel & 0xFF)
+                target.pixels[y * stride + x] = texel;
+        }
+    }
 }
 
 
+void GridGame::setTextureSet(TextureHandler* t)
+{
+    if (t != currentTextureSet) clearOverlayCache();
+    currentTextureSet = t;
+}
+
+SDL_Texture* GridGame::getOverlayTexture(int i)
+{
+    auto cached = overlayCache.find(i);
+    if (cached != overlayCache.end()) return cached->second;
+    const Texture& image = currentTextureSet->textureAt(i);
+    if (!currentTextureSet->isResident(i)) return nullptr; //streamed texture still loading, don't cache the placeholder
+    //textures are column major in memory so lay it back out in rows for SDL
+    std::vector<Uint32> rows(image.width * image.height);
+    for (int y = 0; y < image.height; y++)
+        for (int x = 0; x < image.width; x++) rows[y * image.width + x] = image.at(x, y);
+    SDL_Texture* tex = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_STATIC, image.width, image.height);
+    if (tex)
+    {
+        SDL_UpdateTexture(tex, nullptr, rows.data(), image.width * sizeof(Uint32));
+        SDL_SetTextureBlendMode(tex, SDL_BLENDMODE_BLEND);
+    }
+    overlayCache[i] = tex;
+    return tex;
+}
+
+void GridGame::clearOverlayCache()
+{
+    for (auto& entry : overlayCache)
+        if (entry.second) SDL_DestroyTexture(entry.second);
+    overlayCache.clear();
+}
+
 GridGame::~GridGame()
 {
-    SDL_DestroyTexture(textureBuffer);
+    if (textureBuffer) SDL_DestroyTexture(textureBuffer);
+    clearOverlayCache();
 }
 
-//Texture handler constructor takes in vector of filenames and loads them in
-//Also takes in the renderer to handle a loading screen
-TextureHandler::TextureHandler(SDL_Renderer* renderer, std::vector<std::string> in)
+//Loading screen progress bar with the percentage above it, fraction is 0 to 1
+static void drawLoadingScreen(SDL_Renderer* renderer, TTF_Font* font, float fraction)
 {
-    int width, height;
     SDL_Rect progressBar;
     progressBar.x = nva::SCREEN_WIDTH / 4;
     progressBar.y = nva::SCREEN_HEIGHT / 2;
     progressBar.h = 20;
+    progressBar.w = (nva::SCREEN_WIDTH / 2) * fraction;
+    SDL_SetRenderDrawColor(renderer, 0, 0, 0, 0);
+    SDL_RenderClear(renderer);
+    SDL_SetRenderDrawColor(renderer, 255, 255, 255, 255);
+    SDL_RenderFillRect(renderer, &progressBar);
+    std::string percentage = std::to_string(fraction * 100) + "%";
+    SDL_Color color = { 255, 255, 255 };  // white color_
+    SDL_Surface* surface = TTF_RenderText_Solid(font, percentage.c_str(), color);
+    SDL_Texture* texture = SDL_CreateTextureFromSurface(renderer, surface);
+    int textW = 0;
+    int textH = 0;
+    SDL_QueryTexture(texture, NULL, NULL, &textW, &textH);
+    SDL_Rect dstrect = { (nva::SCREEN_WIDTH - textW) / 2, progressBar.y - textH, textW, textH };
+    SDL_RenderCopy(renderer, texture, NULL, &dstrect);
+    SDL_DestroyTexture(texture);
+    SDL_FreeSurface(surface);
+    SDL_SetRenderDrawColor(renderer, 0, 0, 0, 0);
+    SDL_RenderPresent(renderer);
+}
 
-    // In your loading loop, update the progress bar width based on loading progress
-    int progress = 0;
+//Decodes an image into its mip chain, a 1x1 magenta chain when it couldn't be loaded. Safe to run on any thread
+static std::vector<Texture> decodeChain(const std::string& filename, bool& ok)
+{
+    int width, height;
+    std::vector<unsigned char> image;
+    ok = nva::loadImage(image, filename, width, height);
+    if (!ok)
+    {
+        image = {255, 0, 255, 255}; //1x1 magenta so a missing file shows up instead of reading garbage
+        width = height = 1;
+    }
+    //mip chain down to 1x1 so distant surfaces sample a texture about their on screen size
+    std::vector<Texture> chain(1, Texture(image, width, height));
+    while (chain.back().width > 1 || chain.back().height > 1) chain.push_back(chain.back().halved());
+    return chain;
+}
+
+static size_t chainBytes(const std::vector<Texture>& chain)
+{
+    size_t bytes = 0;
+    for (const Texture& level : chain) bytes += static_cast<size_t>(level.width) * level.height * sizeof(Uint32);
+    return bytes;
+}
 
-    // Set render color to white (for the progress bar)
+//Texture handler constructor takes in vector of filenames and loads them in
+//Also takes in the renderer to handle a loading screen (pass nullptr when running headless)
+TextureHandler::TextureHandler(SDL_Renderer* renderer, std::vector<std::string> in, const std::string& packPath, size_t budgetBytes)
+    : names(in), pack(new TexturePack()), budgetBytes(budgetBytes)
+{
+    if (!packPath.empty()) pack->open(packPath);
+    textures.resize(in.size());
+    if (budgetBytes > 0)
+    {
+        //streamed, everything starts out as the placeholder until update() sees it sampled
+        placeholder.push_back(Texture({128, 128, 128, 255}, 1, 1));
+        lastUse.reset(new std::atomic<Uint32>[in.size()]);
+        for (size_t i = 0; i < in.size(); i++) lastUse[i] = 0;
+        loading.assign(in.size(), 0);
+        return;
+    }
 
-    // Render the progress bar
-    for (auto i = in.begin(); i != in.end(); i++)
+    //cache hits are cheap so they're taken in order here, only the images that need decoding go to the workers.
+    //Every image decodes into its own slot so indexes stay in the order they were asked for
+    std::vector<int> misses;
+    for (size_t i = 0; i < in.size(); i++)
+    {
+        textures[i] = pack->lookup(in[i]);
+        if (textures[i].empty()) misses.push_back(i);
+    }
+    decoded = misses.size();
+    std::vector<char> failed(in.size(), 0);
+    std::atomic<int> finished{0};
+    auto decode = [&](int job, int) {
+        const int i = misses[job];
+        bool ok;
+        textures[i] = decodeChain(in[i], ok);
+        failed[i] = !ok;
+        finished++;
+    };
+
+    if (!misses.empty())
     {
-        progress += 1;
-        progressBar.w = (nva::SCREEN_WIDTH / 2) * ((float)progress / in.size());
-        std::string filename = *i;
-        std::vector<unsigned char> image;
-        bool success = nva::loadImage(image, filename, width, height);
-        if (!success)
+        WorkerPool pool;
+        if (renderer == nullptr) pool.parallelFor(misses.size(), decode); //headless, no loading screen
+        else
         {
-            std::cout << "Error loading image " + filename + "\n";
+            //one font for the whole loading screen instead of opening it again for every texture
+            TTF_Font* font = TTF_OpenFont("./fonts/SuboleyaRegular.ttf", 25);
+            if (font == nullptr) {
+                std::cerr << "Error loading font.";
+            }
+            //the bar redraws at its own rate while the workers decode, a vsynced present never holds up a decode
+            pool.start(misses.size(), decode);
+            do
+            {
+                drawLoadingScreen(renderer, font, (in.size() - misses.size() + finished) / (float)in.size());
+                SDL_PumpEvents(); //keeps the window from being flagged as not responding
+            } while (!pool.waitFor(LOADING_REFRESH_MS));
+            drawLoadingScreen(renderer, font, 1);
+            if (font) TTF_CloseFont(font);
         }
-        loadedTextures.emplace_back(image);
-        loadedTextureSizes.emplace_back(std::make_pair(width, height));
-        SDL_SetRenderDrawColor(renderer, 0, 0, 0, 0);
-        SDL_RenderClear(renderer);
-        SDL_SetRenderDrawColor(renderer, 255, 255, 255, 255);
-        SDL_RenderFillRect(renderer, &progressBar);
-        std::string percentage = std::to_string((progress / (float)in.size()) * 100) + "%";
-        SDL_Color color = { 255, 255, 255 };  // white color_
-        auto font = TTF_OpenFont("./fonts/SuboleyaRegular.ttf", 25);
-        if (font == nullptr) {
-            std::cerr << "Error loading font.";
-        }
-        SDL_Surface* surface = TTF_RenderText_Solid(font, percentage.c_str(), color);
-        SDL_Texture* texture = SDL_CreateTextureFromSurface(renderer, surface);
-        int textW = 0;
-        int textH = 0;
-        SDL_QueryTexture(texture, NULL, NULL, &textW, &textH);
-        SDL_Rect dstrect = { (nva::SCREEN_WIDTH - textW) / 2, progressBar.y - textH, textW, textH };
-        SDL_RenderCopy(renderer, texture, NULL, &dstrect);
-        SDL_DestroyTexture(texture);
-        SDL_FreeSurface(surface);
-        SDL_SetRenderDrawColor(renderer, 0, 0, 0, 0);
-        SDL_RenderPresent(renderer);
-        TTF_CloseFont(font);
     }
-    
+    bool stale = false; //an image decoded fine that the pack doesn't have yet
+    for (int i : misses)
+    {
+        if (failed[i]) std::cout << "Error loading image " + in[i] + "\n";
+        else stale = true;
+    }
+    for (const std::vector<Texture>& chain : textures) residentBytes += chainBytes(chain);
+
+    //keep the mapping the cached textures view, or rebuild the pack when anything had to be decoded
+    if (!stale || packPath.empty()) return;
+    //the old pack gets overwritten so nothing can keep pointing into it
+    for (std::vector<Texture>& chain : textures)
+        for (Texture& level : chain) level.own();
+    pack->releaseMapping();
+    if (!TexturePack::write(packPath, in, textures)) std::cerr << "Couldn't write texture pack " << packPath << "\n";
+}
+
+TextureHandler::~TextureHandler()
+{
+    //the loader writes into batchResults so let it finish before anything goes away
+    if (loader) while (!loader->waitFor(100));
+}
+
+void TextureHandler::install(int i, std::vector<Texture> chain)
+{
+    residentBytes += chainBytes(chain);
+    textures[i] = std::move(chain);
+    loads++;
+}
+
+void TextureHandler::evict(int i)
+{
+    residentBytes -= chainBytes(textures[i]);
+    std::vector<Texture>().swap(textures[i]); //actually hand the memory back
+    evictions++;
+}
+
+void TextureHandler::update()
+{
+    if (budgetBytes == 0) return;
+    const Uint32 sampled = frame; //stamp the frame that just finished rendering wrote
+
+    //take in a finished batch
+    if (!batch.empty() && loader->waitFor(0))
+    {
+        for (size_t k = 0; k < batch.size(); k++)
+        {
+            if (batchFailed[k]) std::cout << "Error loading image " + names[batch[k]] + "\n";
+            install(batch[k], std::move(batchResults[k]));
+            loading[batch[k]] = 0;
+        }
+        batch.clear();
+    }
+
+    //textures sampled last frame that aren't in yet. Pack hits are only a view so they go in right away
+    std::vector<int> wanted;
+    for (size_t i = 0; i < textures.size(); i++)
+    {
+        if (!textures[i].empty() || loading[i] || lastUse[i].load(std::memory_order_relaxed) != sampled) continue;
+        std::vector<Texture> cached = pack->lookup(names[i]);
+        if (!cached.empty()) install(i, std::move(cached));
+        else wanted.push_back(i);
+    }
+    if (!wanted.empty() && batch.empty())
+    {
+        if (!loader) loader.reset(new WorkerPool());
+        batch = wanted;
+        batchResults.assign(batch.size(), std::vector<Texture>());
+        batchFailed.assign(batch.size(), 0);
+        for (int i : batch) loading[i] = 1;
+        decoded += batch.size();
+        loader->start(batch.size(), [this](int job, int) {
+            bool ok;
+            batchResults[job] = decodeChain(names[batch[job]], ok);
+            batchFailed[job] = !ok;
+        });
+    }
+
+    //least recently used first, anything sampled last frame stays even if that leaves us over budget
+    while (residentBytes > budgetBytes)
+    {
+        int oldest = -1;
+        for (size_t i = 0; i < textures.size(); i++)
+        {
+            const Uint32 used = lastUse[i].load(std::memory_order_relaxed);
+            if (!textures[i].empty() && used != sampled && (oldest < 0 || used < lastUse[oldest].load(std::memory_order_relaxed))) oldest = i;
+        }
+        if (oldest < 0) break;
+        evict(oldest);
+    }
+    frame++;
+}
+
+//power of two sizes let the floor caster wrap with a mask
+static int log2Of(int n)
+{
+    int l = 0;
+    while ((1 << l) < n) l++;
+    return ((1 << l) == n) ? l : -1;
+}
+
+Texture::Texture(const std::vector<unsigned char>& rgbaBytes, int w, int h) : width(w), height(h), pixels(w * h)
+{
+    log2W = log2Of(w);
+    log2H = log2Of(h);
+    texels = pixels.data();
+    for (int y = 0; y < h; y++)
+    {
+        for (int x = 0; x < w; x++)
+        {
+            const unsigned char* texel = &rgbaBytes[4 * (y * w + x)];
+            pixels[x * h + y] = (Uint32(texel[0]) << 24) | (Uint32(texel[1]) << 16) | (Uint32(texel[2]) << 8) | Uint32(texel[3]);
+        }
+    }
+}
+
+Texture Texture::view(const Uint32* data, int w, int h)
+{
+    Texture out;
+    out.width = w;
+    out.height = h;
+    out.log2W = log2Of(w);
+    out.log2H = log2Of(h);
+    out.texels = data;
+    return out;
+}
+
+Texture& Texture::operator=(const Texture& other)
+{
+    width = other.width;
+    height = other.height;
+    log2W = other.log2W;
+    log2H = other.log2H;
+    pixels = other.pixels;
+    texels = other.ownsPixels() ? pixels.data() : other.texels;
+    return *this;
+}
+
+void Texture::own()
+{
+    if (ownsPixels() || !texels) return;
+    pixels.assign(texels, texels + width * height);
+    texels = pixels.data();
 }
 
-//might prove to be a bottleneck in performance since this function is called for every pixel being rendered on the wall.... therefore we may need to reduce
-//the call time as much as possible and change the loaded textures class to store in an array instead of a vector
-inline rgba TextureHandler::colorAt(int textureIndex, int x, int y)
+Texture Texture::halved() const
 {
-    const int RGBA = 4; //This might change if you change the loadimage function
-    int r, g, b, a;
-    int index = RGBA * ( y * widthHeightAt(textureIndex).first + x);
-    r = static_cast<int>(loadedTextures[textureIndex][index + 0]);
-    g = static_cast<int>(loadedTextures[textureIndex][index + 1]);
-    b = static_cast<int>(loadedTextures[textureIndex][index + 2]);
-    a = static_cast<int>(loadedTextures[textureIndex][index + 3]);
-    // std::cout << r << " "
-    //           << g << " "
-    //           << b << " "
-    //           << a << " "
-    //           << *(Uint32*)&(loadedTextures[textureIndex][index]) << " "
-    //           << SDL_MapRGBA(SDL_AllocFormat(SDL_PIXELFORMAT_RGBA8888), r, g , b , a) << " "
-    //           << '\n';
-    return { r, g, b, a };
+    Texture out;
+    out.width = std::max(1, width / 2);
+    out.height = std::max(1, height / 2);
+    out.log2W = log2Of(out.width);
+    out.log2H = log2Of(out.height);
+    out.pixels.resize(out.width * out.height);
+    out.texels = out.pixels.data();
+    for (int x = 0; x < out.width; x++)
+    {
+        for (int y = 0; y < out.height; y++)
+        {
+            Uint32 r = 0, g = 0, b = 0, a = 0;
+            for (int i = 0; i < 4; i++)
+            {
+                Uint32 texel = at(std::min(2 * x + (i & 1), width - 1), std::min(2 * y + (i >> 1), height - 1));
+                Uint32 ta = texel & 0xFF;
+                r += (texel >> 24) * ta;
+                g += ((texel >> 16) & 0xFF) * ta;
+                b += ((texel >> 8) & 0xFF) * ta;
+                a += ta;
+            }
+            //sprites alpha test so keep alpha all or nothing, mostly see through texels drop out entirely
+            if (a < 2 * 255)
+            {
+                out.pixels[x * out.height + y] = 0;
+                continue;
+            }
+            r /= a;
+            g /= a;
+            b /= a;
+            out.pixels[x * out.height + y] = (r << 24) | (g << 16) | (b << 8) | 0xFF;
+        }
+    }
+    return out;
 }
 
 void EntityController::createEntityAndSpriteAt(Entity *e, Sprite *s, Point pos, double radius, std::string type)
 {
     e->pos = pos;
+    e->sprite = s;
     s->x = pos.x;
     s->y = pos.y;
     int ID = eh->addEntity(e);
@@ -865,7 +1767,7 @@ void EntityController::updateEntityRelPos(int ID, double x, double y)
             currentPos.y = newPos.y;
 
         // Update the entity's position
-        e->pos = currentPos;
+        eh->moveEntity(e, currentPos);
         m->getSpriteAt(index).x = currentPos.x;
         m->getSpriteAt(index).y = currentPos.y;
         double angle = atan2(y, -x) + M_PI/8;
@@ -882,10 +1784,83 @@ void EntityHandler::deleteEntityByID(int i)
 {
     for (Entity* e : entities)
     {
-        if (e->ID == i) entities.erase(entities.begin() + i);
+        if (e->ID == i)
+        {
+            Entity* gone = entities[i];
+            entities.erase(entities.begin() + i);
+            if (!listed(gone)) unbucket(gone); //the same entity can be added more than once
+            return;
+        }
     }
 }
 
+void EntityHandler::setEntityAt(int i, Entity *e)
+{
+    Entity* old = entities[i];
+    entities[i] = e;
+    if (old != e && !listed(old)) unbucket(old);
+    bucket(e);
+}
+
+//Files an entity that is about to be added. One that isn't listed yet may still carry cells from another handler
+void EntityHandler::track(Entity* e)
+{
+    if (!listed(e))
+    {
+        e->cellMinX = e->cellMinY = 0;
+        e->cellMaxX = e->cellMaxY = -1;
+    }
+    bucket(e);
+}
+
+void EntityHandler::moveEntity(Entity* e, Point pos)
+{
+    e->pos = pos;
+    bucket(e);
+}
+
+const std::vector<Entity*>* EntityHandler::entitiesIn(int x, int y) const
+{
+    auto it = buckets.find(cellKey(x, y));
+    return (it == buckets.end()) ? nullptr : &it->second;
+}
+
+//Files e under every cell its bounding box covers, leaving it alone when that hasn't changed
+void EntityHandler::bucket(Entity* e)
+{
+    const int minX = static_cast<int>(floor(e->pos.x - e->radius)), maxX = static_cast<int>(floor(e->pos.x + e->radius));
+    const int minY = static_cast<int>(floor(e->pos.y - e->radius)), maxY = static_cast<int>(floor(e->pos.y + e->radius));
+    if (minX == e->cellMinX && maxX == e->cellMaxX && minY == e->cellMinY && maxY == e->cellMaxY) return;
+    unbucket(e);
+    for (int y = minY; y <= maxY; y++)
+        for (int x = minX; x <= maxX; x++)
+            buckets[cellKey(x, y)].push_back(e);
+    e->cellMinX = minX;
+    e->cellMaxX = maxX;
+    e->cellMinY = minY;
+    e->cellMaxY = maxY;
+}
+
+void EntityHandler::unbucket(Entity* e)
+{
+    for (int y = e->cellMinY; y <= e->cellMaxY; y++)
+        for (int x = e->cellMinX; x <= e->cellMaxX; x++)
+        {
+            auto it = buckets.find(cellKey(x, y));
+            if (it == buckets.end()) continue;
+            std::vector<Entity*>& list = it->second;
+            auto found = std::find(list.begin(), list.end(), e);
+            if (found != list.end())
+            {
+                *found = list.back();
+                list.pop_back();
+            }
+            if (list.empty()) buckets.erase(it);
+        }
+    e->cellMinX = e->cellMinY = 0;
+    e->cellMaxX = e->cellMaxY = -1;
+}
+
 Entity* EntityHandler::getEntityByID(int i)
 {
     for (Entity* e : entities)
@@ -894,85 +1869,478 @@ Entity* EntityHandler::getEntityByID(int i)
     }
 }
 
-Door Map::getDoorByID(int ID)
+//Chunk file layout: this header, the door table, then every chunk's cells in chunk table order
+struct ChunkFileHeader
+{
+    char magic[4] = {'N', 'V', 'C', 'K'};
+    Uint32 version = 1;
+    Sint32 width = 0;
+    Sint32 height = 0;
+    Sint32 chunkShift = nva::CHUNK_SHIFT;
+    Sint32 skyTexture = 0;
+    Uint32 doorCount = 0;
+};
+
+static bool seekFile(FILE* f, long long offset)
+{
+#ifdef _WIN32
+    return _fseeki64(f, offset, SEEK_SET) == 0;
+#else
+    return fseeko(f, offset, SEEK_SET) == 0;
+#endif
+}
+
+Map::Map(const std::vector<std::vector<int>>& m, std::vector<Sprite> s) : width(m.empty() ? 0 : m[0].size()), height(m.size())
 {
-    for (int y = 0; y < doorMap.size(); y++)
+    allocateChunks();
+    //built in memory so every chunk is resident for good
+    for (int i = 0; i < chunksX * chunksY; i++)
+    {
+        chunks[i].cells.reset(new Cell[nva::CHUNK_CELLS]);
+        chunkTable[i] = chunks[i].cells.get();
+        residentChunks.push_back(i);
+    }
+    for (int y = 0; y < height; y++)
     {
-        for (int x = 0; x < doorMap[0].size(); x++)
+        for (int x = 0; x < width; x++)
         {
-            if(doorMap[y][x].ID == ID)
-            { 
-                return doorMap[y][x];
+            Cell& c = mutableCellAt(x, y);
+            c.wall = m[y][x];
+            if (c.wall) c.flags |= CELL_SOLID;
+        }
+    }
+    updateSkipField(0, 0, width - 1, height - 1);
+    updateWalkField(0, 0, width - 1, height - 1);
+}
+
+Map::Map(const std::string& chunkFile, size_t residentBudgetBytes)
+{
+    ChunkFileHeader header, expected;
+    pageFile = fopen(chunkFile.c_str(), "r+b");
+    if (!pageFile || fread(&header, sizeof(header), 1, pageFile) != 1 || memcmp(header.magic, expected.magic, 4) != 0 ||
+        header.version != expected.version || header.chunkShift != nva::CHUNK_SHIFT)
+    {
+        std::cerr << "Couldn't open chunk file " << chunkFile << "\n";
+        if (pageFile) fclose(pageFile);
+        pageFile = nullptr;
+        return;
+    }
+    width = header.width;
+    height = header.height;
+    skyTexture = header.skyTexture;
+    doors.resize(header.doorCount);
+    if (header.doorCount && fread(doors.data(), sizeof(Door), header.doorCount, pageFile) != header.doorCount)
+        std::cerr << "Chunk file " << chunkFile << " has a short door table\n";
+    chunkDataOffset = sizeof(header) + static_cast<long long>(header.doorCount) * sizeof(Door);
+    allocateChunks();
+    //never less than what streamAround pins around the player
+    const size_t pinned = (2 * nva::STREAM_RADIUS + 1) * (2 * nva::STREAM_RADIUS + 1);
+    budgetChunks = std::max(pinned, residentBudgetBytes / (nva::CHUNK_CELLS * sizeof(Cell)));
+    indexDoors();
+    skipField.assign(static_cast<size_t>(width) * height, 0); //nothing resident yet, chunks fill it in as they load
+    walkField.assign(static_cast<size_t>(width) * height, 0);
+}
+
+Map::Map(LevelFile& level)
+{
+    if (!level.isOpen()) return;
+    const LevelHeader& header = level.header();
+    width = header.width;
+    height = header.height;
+    skyTexture = header.skyTexture;
+    allocateChunks();
+    //the mapping is the storage, pages fault in as the renderer first touches them
+    for (int i = 0; i < chunksX * chunksY; i++)
+    {
+        chunkTable[i] = level.chunkCells(i);
+        residentChunks.push_back(i);
+    }
+    doors = level.doors();
+    indexDoors();
+    mappedLevel = level.releaseMapping();
+    updateSkipField(0, 0, width - 1, height - 1);
+    updateWalkField(0, 0, width - 1, height - 1);
+}
+
+Map::~Map()
+{
+    if (!pageFile) return;
+    while (!residentChunks.empty()) evictChunk(residentChunks.back());
+    fclose(pageFile);
+}
+
+void Map::allocateChunks()
+{
+    chunksX = (width + nva::CHUNK_SIZE - 1) >> nva::CHUNK_SHIFT;
+    chunksY = (height + nva::CHUNK_SIZE - 1) >> nva::CHUNK_SHIFT;
+    chunkTable.assign(chunksX * chunksY, nullptr);
+    chunks.clear();
+    chunks.resize(chunksX * chunksY);
+    residentChunks.clear();
+    chunkWanted.reset(new std::atomic<bool>[chunksX * chunksY]);
+    for (int i = 0; i < chunksX * chunksY; i++) chunkWanted[i].store(false, std::memory_order_relaxed);
+}
+
+//called from the render workers, only touches the flag when it isn't set already so they don't fight over the line
+void Map::requestChunk(int x, int y) const
+{
+    std::atomic<bool>& wanted = chunkWanted[(y >> nva::CHUNK_SHIFT) * chunksX + (x >> nva::CHUNK_SHIFT)];
+    if (!wanted.load(std::memory_order_relaxed)) wanted.store(true, std::memory_order_relaxed);
+}
+
+bool Map::readChunk(int index, Cell* dst) const
+{
+    const long long chunkBytes = nva::CHUNK_CELLS * sizeof(Cell);
+    return seekFile(pageFile, chunkDataOffset + index * chunkBytes) && fread(dst, sizeof(Cell), nva::CHUNK_CELLS, pageFile) == static_cast<size_t>(nva::CHUNK_CELLS);
+}
+
+bool Map::loadChunk(int index)
+{
+    if (chunkTable[index]) return true;
+    if (!pageFile) return false;
+    std::unique_ptr<Cell[]> cells(new Cell[nva::CHUNK_CELLS]);
+    if (!readChunk(index, cells.get()))
+    {
+        std::cerr << "Failed to read map chunk " << index << "\n";
+        return false;
+    }
+    chunks[index].cells = std::move(cells);
+    chunks[index].dirty = false;
+    chunkTable[index] = chunks[index].cells.get();
+    residentChunks.push_back(index);
+    chunkLoads++;
+    layoutRevision++;
+    const int x0 = (index % chunksX) << nva::CHUNK_SHIFT, y0 = (index / chunksX) << nva::CHUNK_SHIFT;
+    updateSkipField(x0, y0, x0 + nva::CHUNK_SIZE - 1, y0 + nva::CHUNK_SIZE - 1);
+    updateWalkField(x0, y0, x0 + nva::CHUNK_SIZE - 1, y0 + nva::CHUNK_SIZE - 1);
+    return true;
+}
+
+void Map::evictChunk(int index)
+{
+    MapChunk& chunk = chunks[index];
+    if (chunk.dirty)
+    {
+        const long long chunkBytes = nva::CHUNK_CELLS * sizeof(Cell);
+        if (!seekFile(pageFile, chunkDataOffset + index * chunkBytes) || fwrite(chunk.cells.get(), sizeof(Cell), nva::CHUNK_CELLS, pageFile) != static_cast<size_t>(nva::CHUNK_CELLS))
+            std::cerr << "Failed to write back map chunk " << index << "\n";
+    }
+    chunkTable[index] = nullptr;
+    chunk.cells.reset();
+    chunk.dirty = false;
+    auto it = std::find(residentChunks.begin(), residentChunks.end(), index);
+    *it = residentChunks.back();
+    residentChunks.pop_back();
+    layoutRevision++;
+    const int x0 = (index % chunksX) << nva::CHUNK_SHIFT, y0 = (index / chunksX) << nva::CHUNK_SHIFT;
+    updateSkipField(x0, y0, x0 + nva::CHUNK_SIZE - 1, y0 + nva::CHUNK_SIZE - 1);
+    updateWalkField(x0, y0, x0 + nva::CHUNK_SIZE - 1, y0 + nva::CHUNK_SIZE - 1);
+}
+
+void Map::setTileAt(int x, int y, int wall)
+{
+    Cell& c = mutableCellAt(x, y);
+    c.wall = wall;
+    if (wall) c.flags |= CELL_SOLID;
+    else c.flags &= ~CELL_SOLID;
+    layoutRevision++;
+    updateSkipField(x, y, x, y);
+    updateWalkField(x, y, x, y);
+}
+
+void Map::updateWalkField(int x0, int y0, int x1, int y1)
+{
+    if (walkField.size() != static_cast<size_t>(width) * height) walkField.assign(static_cast<size_t>(width) * height, 0);
+    for (int y = std::max(0, y0); y <= std::min(height - 1, y1); y++)
+        for (int x = std::max(0, x0); x <= std::min(width - 1, x1); x++)
+        {
+            //peek, paged out cells are blocked and asking for them here would page evicted chunks straight back in
+            const Cell& c = peekCellAt(x, y);
+            walkField[y * width + x] = !(c.flags & CELL_UNLOADED) && c.wall == 0;
+        }
+}
+
+void Map::updateSkipField(int x0, int y0, int x1, int y1)
+{
+    const int SKIP = nva::SKIP_MAX;
+    if (skipField.size() != static_cast<size_t>(width) * height) skipField.assign(static_cast<size_t>(width) * height, 0);
+    //cells within SKIP of the change can get new values and those depend on cells within SKIP of them, so the
+    //distance transform runs over a window twice as wide and only the inner part gets written back
+    const int wx0 = std::max(0, x0 - 2 * SKIP), wy0 = std::max(0, y0 - 2 * SKIP);
+    const int wx1 = std::min(width - 1, x1 + 2 * SKIP), wy1 = std::min(height - 1, y1 + 2 * SKIP);
+    if (wx0 > wx1 || wy0 > wy1) return;
+    const int w = wx1 - wx0 + 1, h = wy1 - wy0 + 1;
+    std::vector<Uint8> d(static_cast<size_t>(w) * h);
+    for (int y = 0; y < h; y++)
+    {
+        for (int x = 0; x < w; x++)
+        {
+            //peek, going through cellAt would ask for every paged out chunk nearby. Those read as walls
+            const Cell& c = peekCellAt(wx0 + x, wy0 + y);
+            d[y * w + x] = (c.wall || (c.flags & CELL_DOOR)) ? 0 : SKIP;
+        }
+    }
+    //two pass chamfer with unit weights on all 8 neighbours is exact for Chebyshev distance. Off the map counts as solid
+    auto at = [&](int x, int y) -> int {
+        if (wx0 + x < 0 || wy0 + y < 0 || wx0 + x >= width || wy0 + y >= height) return 0;
+        if (x < 0 || y < 0 || x >= w || y >= h) return SKIP;
+        return d[y * w + x];
+    };
+    for (int y = 0; y < h; y++)
+        for (int x = 0; x < w; x++)
+            d[y * w + x] = std::min<int>(d[y * w + x], 1 + std::min(std::min(at(x - 1, y), at(x - 1, y - 1)), std::min(at(x, y - 1), at(x + 1, y - 1))));
+    for (int y = h - 1; y >= 0; y--)
+        for (int x = w - 1; x >= 0; x--)
+            d[y * w + x] = std::min<int>(d[y * w + x], 1 + std::min(std::min(at(x + 1, y), at(x + 1, y + 1)), std::min(at(x, y + 1), at(x - 1, y + 1))));
+    for (int y = std::max(0, y0 - SKIP); y <= std::min(height - 1, y1 + SKIP); y++)
+        for (int x = std::max(0, x0 - SKIP); x <= std::min(width - 1, x1 + SKIP); x++) skipField[y * width + x] = d[(y - wy0) * w + (x - wx0)];
+}
+
+Cell& Map::mutableCellAt(int x, int y)
+{
+    const int index = (y >> nva::CHUNK_SHIFT) * chunksX + (x >> nva::CHUNK_SHIFT);
+    loadChunk(index);
+    if (pageFile) chunks[index].dirty = true;
+    return chunkTable[index][((y & (nva::CHUNK_SIZE - 1)) << nva::CHUNK_SHIFT) | (x & (nva::CHUNK_SIZE - 1))];
+}
+
+void Map::streamAround(Point p, int radius)
+{
+    if (!pageFile) return;
+    const int pcx = static_cast<int>(p.x) >> nva::CHUNK_SHIFT;
+    const int pcy = static_cast<int>(p.y) >> nva::CHUNK_SHIFT;
+    auto distance = [&](int index) { return std::max(std::abs(index % chunksX - pcx), std::abs(index / chunksX - pcy)); };
+    std::vector<int> wanted;
+    for (int cy = std::max(0, pcy - radius); cy <= std::min(chunksY - 1, pcy + radius); cy++)
+        for (int cx = std::max(0, pcx - radius); cx <= std::min(chunksX - 1, pcx + radius); cx++) wanted.push_back(cy * chunksX + cx);
+    for (int i = 0; i < chunksX * chunksY; i++)
+        if (chunkWanted[i].exchange(false, std::memory_order_relaxed)) wanted.push_back(i);
+    std::sort(wanted.begin(), wanted.end(), [&](int a, int b) { return distance(a) < distance(b); });
+    for (int index : wanted)
+    {
+        if (chunkTable[index]) continue;
+        //make room by dropping whatever is farthest, but never for something farther away than it
+        while (residentChunks.size() >= budgetChunks)
+        {
+            int farthest = *std::max_element(residentChunks.begin(), residentChunks.end(), [&](int a, int b) { return distance(a) < distance(b); });
+            if (distance(farthest) <= distance(index)) return;
+            evictChunk(farthest);
+        }
+        loadChunk(index);
+    }
+}
+
+bool Map::copyChunk(int index, Cell* dst) const
+{
+    if (chunkTable[index])
+    {
+        std::copy(chunkTable[index], chunkTable[index] + nva::CHUNK_CELLS, dst);
+        return true;
+    }
+    return pageFile && readChunk(index, dst);
+}
+
+bool Map::saveChunkFile(const std::string& path) const
+{
+    FILE* out = fopen(path.c_str(), "wb");
+    if (!out) return false;
+    ChunkFileHeader header;
+    header.width = width;
+    header.height = height;
+    header.skyTexture = skyTexture;
+    header.doorCount = doors.size();
+    bool ok = fwrite(&header, sizeof(header), 1, out) == 1;
+    if (!doors.empty()) ok = ok && fwrite(doors.data(), sizeof(Door), doors.size(), out) == doors.size();
+    std::unique_ptr<Cell[]> cells(new Cell[nva::CHUNK_CELLS]);
+    for (int i = 0; ok && i < chunksX * chunksY; i++)
+        ok = copyChunk(i, cells.get()) && fwrite(cells.get(), sizeof(Cell), nva::CHUNK_CELLS, out) == static_cast<size_t>(nva::CHUNK_CELLS);
+    fclose(out);
+    return ok;
+}
+
+void Map::setFloorMap(const std::vector<std::vector<int>>& m)
+{
+    for (int y = 0; y < height; y++)
+        for (int x = 0; x < width; x++) mutableCellAt(x, y).floor = m[y][x];
+}
+
+void Map::setCeilingMap(const std::vector<std::vector<int>>& m)
+{
+    for (int y = 0; y < height; y++)
+    {
+        for (int x = 0; x < width; x++)
+        {
+            Cell& c = mutableCellAt(x, y);
+            if (m[y][x] == SKY)
+            {
+                c.flags |= CELL_SKY;
+                c.ceiling = 0;
+            }
+            else
+            {
+                c.flags &= ~CELL_SKY;
+                c.ceiling = m[y][x];
             }
         }
     }
-    return {0};
 }
 
-void Map::setDoorByID(int ID, Door d)
+void Map::setDoorMap(const std::vector<std::vector<Door>>& m)
 {
-    for (int y = 0; y < doorMap.size(); y++)
+    if (pageFile)
     {
-        for (int x = 0; x < doorMap[0].size(); x++)
+        std::cerr << "Can't replace the doors of a streaming map\n";
+        return;
+    }
+    doors.clear();
+    int dropped = 0;
+    for (int y = 0; y < height; y++)
+        for (int x = 0; x < width; x++)
         {
-            if(doorMap[y][x].ID == ID)
-            { 
-                doorMap[y][x] = d;
+            Cell& c = mutableCellAt(x, y);
+            c.door = -1;
+            c.flags &= ~CELL_DOOR;
+            if (!m[y][x].exists) continue;
+            if (doors.size() >= nva::MAX_DOORS)
+            {
+                dropped++;
+                continue;
             }
+            c.door = doors.size();
+            c.flags |= CELL_DOOR;
+            doors.push_back(m[y][x]);
+            doors.back().x = x;
+            doors.back().y = y;
+        }
+    if (dropped) std::cerr << "Door map has more than " << nva::MAX_DOORS << " doors, dropped " << dropped << "\n";
+    indexDoors();
+    updateSkipField(0, 0, width - 1, height - 1);
+}
+
+void Map::setDoorStateAt(int x, int y, Door d)
+{
+    Cell& c = mutableCellAt(x, y);
+    d.x = x;
+    d.y = y;
+    if (c.door < 0)
+    {
+        if (!d.exists) return;
+        if (pageFile || doors.size() >= nva::MAX_DOORS)
+        {
+            std::cerr << "Can't add a door at " << x << ", " << y << (pageFile ? " to a streaming map\n" : ", the door table is full\n");
+            return;
         }
+        c.door = doors.size();
+        c.flags |= CELL_DOOR;
+        doors.push_back(d);
+        updateSkipField(x, y, x, y);
     }
+    else doors[c.door] = d;
+    indexDoors();
 }
 
-void Map::toggleDoorByID(int ID)
+//rebuilds the ID lookup, only needed when doors are added or replaced not when they animate
+void Map::indexDoors()
 {
-    doorsInProgress.insert(ID); // keep track so updating doors is fast
-    Door tempd = getDoorByID(ID);
-    if (tempd.state == DOOR_CLOSED)
+    doorIndexesByID.clear();
+    for (int i = 0; i < static_cast<int>(doors.size()); i++)
+        if (doors[i].exists) doorIndexesByID[doors[i].ID].push_back(i);
+}
+
+const std::vector<int>& Map::getDoorIndexes(int ID) const
+{
+    static const std::vector<int> none;
+    auto found = doorIndexesByID.find(ID);
+    return (found != doorIndexesByID.end()) ? found->second : none;
+}
+
+void Map::setLightMap(const std::vector<std::vector<double>>& d)
+{
+    for (int y = 0; y < height; y++)
+        for (int x = 0; x < width; x++) setLightStateAt(x, y, d[y][x]);
+}
+
+Door Map::getDoorByID(int ID) const
+{
+    const std::vector<int>& linked = getDoorIndexes(ID);
+    if (linked.empty()) return {0};
+    return doors[linked[0]];
+}
+
+void Map::setDoorByID(int ID, Door d)
+{
+    for (int i : getDoorIndexes(ID))
     {
-        tempd.state = DOOR_OPENING;
-        tempd.doorState = true;
-        setDoorByID(ID, tempd);
+        //every linked door keeps its own cell
+        Door& door = doors[i];
+        int x = door.x, y = door.y;
+        door = d;
+        door.x = x;
+        door.y = y;
     }
-    if (tempd.state == DOOR_OPEN)
+}
+
+void Map::toggleDoorByID(int ID)
+{
+    const std::vector<int>& linked = getDoorIndexes(ID);
+    if (linked.empty()) return;
+    // keep track so updating doors is fast
+    if (std::find(activeDoors.begin(), activeDoors.end(), ID) == activeDoors.end()) activeDoors.push_back(ID);
+    for (int i : linked)
     {
-        tempd.state = DOOR_CLOSING;
-        tempd.doorState = true;
-        setDoorByID(ID, tempd);
+        Door& door = doors[i];
+        if (door.state == DOOR_CLOSED)
+        {
+            door.state = DOOR_OPENING;
+            door.doorState = true;
+        }
+        else if (door.state == DOOR_OPEN)
+        {
+            door.state = DOOR_CLOSING;
+            door.doorState = true;
+        }
     }
 }
 
 void Map::updateDoors(double t)
 {
-    if (!doorsInProgress.empty())
+    //finished IDs are swapped with the last one and popped, so index i is looked at again instead of skipped
+    for (size_t i = 0; i < activeDoors.size();)
     {
-        for (int id : doorsInProgress)
+        bool moving = false;
+        for (int index : getDoorIndexes(activeDoors[i]))
         {
-            Door tempd = getDoorByID(id);
-            if (tempd.state == DOOR_CLOSING)
+            Door& door = doors[index];
+            if (door.state == DOOR_CLOSING)
             {
-                tempd.doorProgress += t * tempd.doorTime;
-                if (tempd.doorProgress >= 1)
+                door.doorProgress += t * door.doorTime;
+                if (door.doorProgress >= 1)
                 {
-                    tempd.doorProgress = 1;
-                    tempd.state = DOOR_CLOSED;
-                    tempd.doorState = true;
-                    doorsInProgress.erase(doorsInProgress.find(id));
+                    door.doorProgress = 1;
+                    door.state = DOOR_CLOSED;
+                    door.doorState = true;
                 }
-                setDoorByID(id, tempd);
+                else moving = true;
             }
-            else if (tempd.state == DOOR_OPENING)
+            else if (door.state == DOOR_OPENING)
             {
-                tempd.doorProgress -= t * tempd.doorTime;
-                if (tempd.doorProgress <= 0)
+                door.doorProgress -= t * door.doorTime;
+                if (door.doorProgress <= 0)
                 {
-                    tempd.doorProgress = 0;
-                    tempd.state = DOOR_OPEN;
-                    tempd.doorState = false;
-                    doorsInProgress.erase(doorsInProgress.find(id));
+                    door.doorProgress = 0;
+                    door.state = DOOR_OPEN;
+                    door.doorState = false;
                 }
-                setDoorByID(id, tempd);
+                else moving = true;
             }
         }
+        if (moving)
+        {
+            i++;
+            continue;
+        }
+        activeDoors[i] = activeDoors.back();
+        activeDoors.pop_back();
     }
 }
 
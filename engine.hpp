@@ -31,6 +31,12 @@ https://creativecommons.org/licenses/by-sa/4.0/
 #include <unordered_set>
 #include <string>
 #include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <cstdio>
 #include <unordered_map>
 #include <SDL2/SDL_ttf.h>
 #include "./src/include/SDL2/SDL_fox.h"
@@ -80,16 +86,129 @@ namespace nva
     inline T clamp(const T& n, const T& lower, const T& upper) {
         return (n < lower) ? lower : (n > upper) ? upper : n;
     }
+    const char* const IMAGE_DIR = "./images/"; //image filenames are relative to this
     bool loadImage(std::vector<unsigned char>& image, const std::string& filename, int& x, int&y);
-    const int MAX_THREADS = 1; //Attempt at multithreading not working well lol
+    const int MAX_THREADS = 16; //upper bound on render workers, the pool sizes itself to the core count below this
+    const int CHUNKS_PER_WORKER = 4; //column chunks handed out per worker each frame so one slow chunk doesn't stall the rest
+    const int ROWS_PER_JOB = 4; //floor rows per render pool job
+    const int CHUNK_SHIFT = 5; //maps are stored in 32x32 cell chunks
+    const int CHUNK_SIZE = 1 << CHUNK_SHIFT;
+    const int CHUNK_CELLS = CHUNK_SIZE * CHUNK_SIZE;
+    const int STREAM_RADIUS = 2; //chunks kept loaded around the player in every direction when streaming
+    const int MAX_DOORS = 32767; //Cell::door is a Sint16 index into the door table
+    const int SKIP_MAX = 32; //cap on the empty space skip distance, also how far an edit can change it
+    const double SHOT_RANGE = 10; //hitscan reach in map units
+    const int SIGHT_PER_JOB = 32; //line of sight queries per worker pool job
+    const int RAY_PACKET = 4; //neighbouring wall columns cast together, two SSE2 registers of doubles
     const double BRIGHTNESS = 10; //resolution of the brightness scale
+    const int SHADE_LEVELS = 64; //light levels the lightmap and fog get quantized into
     const int SCREEN_WIDTH = 1280;
     const int SCREEN_HEIGHT = 720;
     inline bool checkCirc(double cx, double cy, double r, double x, double y) {
         return ((x - cx) * (x - cx) + (y - cy) * (y - cy)) <= r * r;
     }
+    inline double ticksToMs(Uint64 ticks) { return ticks * 1000.0 / SDL_GetPerformanceFrequency(); }
 }
 
+//Persistent pool of worker threads so we aren't spawning threads every frame.
+//parallelFor hands out job indexes through an atomic counter and the calling thread works too (always as worker 0).
+class WorkerPool
+{
+public:
+    WorkerPool(int maxThreads = nva::MAX_THREADS);
+    ~WorkerPool();
+    //number of workers including the calling thread
+    int size() const { return static_cast<int>(threads.size()) + 1; };
+    //runs fn(job, worker) for every job in [0, jobs) and returns once they are all done
+    void parallelFor(int jobs, const std::function<void(int, int)>& fn);
+    //same job hand out but returns straight away so the caller can keep doing its own work, only the pool
+    //threads run the jobs. One batch at a time, finish it with waitFor before starting anything else
+    void start(int jobs, std::function<void(int, int)> fn);
+    //waits up to ms for the started batch, true once every job has finished
+    bool waitFor(int ms);
+private:
+    void workerLoop(int worker);
+    void runJobs(int worker);
+    std::vector<std::thread> threads;
+    std::mutex mtx;
+    std::condition_variable wake;
+    std::condition_variable finished;
+    const std::function<void(int, int)>* task = nullptr;
+    std::function<void(int, int)> startedTask; //start() outlives its caller's copy of fn
+    std::atomic<int> nextJob{0};
+    int jobCount = 0;
+    int busyWorkers = 0;
+    Uint64 generation = 0;
+    bool stopping = false;
+};
+
+//Per worker scratch for the render pool. Each one sits on its own cache line so workers never false share
+struct alignas(64) RenderScratch
+{
+    //performance counter ticks spent in each cast stage this frame
+    Uint64 ddaTicks = 0;
+    Uint64 wallTicks = 0;
+    Uint64 floorTicks = 0;
+    Uint64 ddaSteps = 0;
+    Uint64 pixelsWritten = 0;
+    std::vector<Uint32> column; //wall texels of the current column, shaded in one pass before being written out
+};
+
+enum RenderStage { STAGE_WALL_DDA, STAGE_WALL_TEXTURE, STAGE_FLOOR_CEILING, STAGE_SPRITE_SORT, STAGE_SPRITE_DRAW,
+                   STAGE_TEXTURE_UPLOAD, STAGE_GUN_OVERLAY, STAGE_HUD_TEXT, STAGE_PRESENT, STAGE_COUNT };
+
+//Where the time went in the last frame. The cast stages run on the render pool so their times are summed
+//across workers (cpu time), castMs is the wall clock time of the whole parallel cast
+struct RenderStats
+{
+    double stageMs[STAGE_COUNT] = {};
+    double castMs = 0;
+    double frameMs = 0;
+    Uint64 ddaSteps = 0; //grid cells visited by wall rays
+    Uint64 pixelsWritten = 0;
+    int spritesDrawn = 0;
+    static const char* stageName(int stage);
+};
+
+//Screen space HUD text kept in one transparent render target texture. Lines only get laid out again when their
+//text actually changes, every other frame the whole layer is a single RenderCopy
+class HudText
+{
+public:
+    HudText() {};
+    HudText(const HudText&) = delete;
+    HudText& operator=(const HudText&) = delete;
+    ~HudText();
+    //adds a line of text at a screen position and returns its handle
+    int addLine(SDL_Point pos, const std::string& text = "");
+    void setText(int line, const std::string& text);
+    //label followed by a number, only formatted again when the value or label changes
+    void setValue(int line, const std::string& label, int value);
+    const std::string& getText(int line) const { return lines[line].text; };
+    //forces a full re-render, call when the renderer loses its target textures (SDL_RENDER_TARGETS_RESET)
+    void invalidate() { dirty = true; };
+    bool isDirty() const { return dirty; };
+    //number of times the layer has been laid out, for profiling
+    Uint64 getRebuilds() const { return rebuilds; };
+    //re-renders the layer if something changed then draws it over the whole output
+    void draw(SDL_Renderer* renderer, FOX_Font* font);
+private:
+    struct Line
+    {
+        SDL_Point pos;
+        std::string text;
+        std::string label;
+        int value = 0;
+        bool hasValue = false;
+    };
+    std::vector<Line> lines;
+    SDL_Texture* layer = nullptr;
+    int layerW = 0;
+    int layerH = 0;
+    bool dirty = true;
+    Uint64 rebuilds = 0;
+};
+
 struct Door
 {
     bool exists = false;
@@ -100,11 +219,40 @@ struct Door
     int ID = -1; // ID NEEDED FOR LINKING TOGGLE OF DOORS
     double doorTime = 1; //speed in units per second in which the door opens
     DoorState state = DOOR_CLOSING;
+    int x = -1, y = -1; //cell the door sits in, filled in by the map
 };
 
 //Convenience
 struct rgba { int r,g,b,a; } ;
 
+//Quantized light levels. Level 0 is full bright and the last level is black, each level is a fixed point
+//multiplier (256 = 1.0) applied to the colour channels of a packed RGBA8888 pixel. Fog pushes levels darker with distance
+class ShadeTable
+{
+public:
+    ShadeTable();
+    //level for a lightmap value (0 dark - 1 bright) seen from distance map units away
+    int level(double light, double distance = 0) const;
+    Uint32 scaleAt(int level) const { return scale[level]; };
+    //fog density per map unit, 0 turns it off
+    void setFog(double density) { fogDensity = density; };
+    double getFog() const { return fogDensity; };
+    //scales R, G and B of an RGBA8888 pixel by scale/256, two channels per multiply. Alpha is left alone
+    static inline Uint32 shade(Uint32 px, Uint32 scale)
+    {
+        Uint32 rb = (px >> 8) & 0x00FF00FF;
+        Uint32 g = (px >> 16) & 0xFF;
+        rb = ((rb * scale) >> 8) & 0x00FF00FF;
+        g = (g * scale) >> 8;
+        return (rb << 8) | (g << 16) | (px & 0xFF);
+    };
+    //shades n contiguous pixels, no branches or lookups per pixel so the compiler can vectorize it
+    static void shadeSpan(Uint32* dst, const Uint32* src, int n, Uint32 scale);
+private:
+    Uint32 scale[nva::SHADE_LEVELS];
+    double fogDensity = 0;
+};
+
 
 
 struct Sprite
@@ -128,7 +276,10 @@ struct Entity
     std::string nametype;
     int HP = 100;
     int ID;
-    
+    //cells the entity is filed under in its handler's buckets, max < min while it isn't filed anywhere.
+    //Move entities through EntityHandler::moveEntity so these follow
+    int cellMinX = 0, cellMinY = 0, cellMaxX = -1, cellMaxY = -1;
+    Sprite* sprite = nullptr; //set when EntityController::createEntityAndSpriteAt pairs it with one
     
     //can add sprite information and loop through and handle all the entities on the map during the game loop
     //change and update their sprites appropriately
@@ -138,42 +289,132 @@ class EntityHandler
 private:
     std::vector<Entity*> entities;
     inline static int ID = 0;
+    //every cell an entity's circle could reach lists it, so ray queries only look at entities in the cells they cross
+    std::unordered_map<Uint64, std::vector<Entity*>> buckets;
+    static Uint64 cellKey(int x, int y) { return (static_cast<Uint64>(static_cast<Uint32>(y)) << 32) | static_cast<Uint32>(x); };
+    void bucket(Entity* e);
+    void unbucket(Entity* e);
+    void track(Entity* e);
+    bool listed(Entity* e) const { return std::find(entities.begin(), entities.end(), e) != entities.end(); };
 public:
     EntityHandler() {};
     EntityHandler(std::vector<Entity*> e){
         for (auto i = e.begin(); i != e.end(); i++){
             (**i).ID = ID;
             ID++;
+            track(*i);
             entities.push_back(*i); }}
     int addEntity(Entity *i) { 
         i->ID = ID;
         ID++;
+        track(i);
         entities.push_back(i); 
         return (ID - 1);
         };
     Entity* entityAt(int i) { return entities.at(i); };
-    void setEntityAt(int i, Entity *e) { entities[i] = e; };
+    void setEntityAt(int i, Entity *e);
     std::vector<Entity*>& getEntityVec() { return entities; };
     void deleteEntityByID(int i);
     Entity* getEntityByID(int i);
+    //sets the position and refiles the entity if it crossed into different cells
+    void moveEntity(Entity* e, Point pos);
+    //entities whose circle may overlap cell x, y. nullptr when there are none
+    const std::vector<Entity*>* entitiesIn(int x, int y) const;
 };
 
-//This class will handle loading all necessary texture images
+class MappedFile;
+class LevelFile;
+class TexturePack;
+
+//Texture converted once at load into the framebuffer's RGBA8888 layout. Stored column major since walls and
+//sprites are drawn a screen column at a time, so a column of texels is one sequential run of memory
+struct Texture
+{
+    int width = 0;
+    int height = 0;
+    int log2W = -1; //log2 of the size, -1 when it isn't a power of two
+    int log2H = -1;
+    std::vector<Uint32> pixels; //owned texels, empty when the texture views a texture pack mapping
+    const Uint32* texels = nullptr; //what gets sampled, either pixels or the mapping
+    Texture() {};
+    //takes the 4 byte per texel row major image loadImage hands back
+    Texture(const std::vector<unsigned char>& rgbaBytes, int w, int h);
+    //wraps already converted column major texels without copying them, they have to outlive the texture
+    static Texture view(const Uint32* data, int w, int h);
+    Texture(const Texture& other) { *this = other; };
+    Texture(Texture&&) = default; //the vector keeps its buffer on a move so texels stays valid
+    Texture& operator=(const Texture& other);
+    Texture& operator=(Texture&&) = default;
+    bool ownsPixels() const { return !pixels.empty(); };
+    //copies a view into its own storage so the mapping behind it can go away
+    void own();
+    Uint32 at(int x, int y) const { return texels[x * height + y]; };
+    const Uint32* column(int x) const { return &texels[x * height]; };
+    //tiles a texel coordinate back into the texture, masks when the size allows it
+    int wrapX(int x) const { return (log2W >= 0) ? (x & (width - 1)) : ((x % width) + width) % width; };
+    int wrapY(int y) const { return (log2H >= 0) ? (y & (height - 1)) : ((y % height) + height) % height; };
+    //next mip level down, a 2x2 box filter weighted by alpha so cutout edges don't bleed into the colour
+    Texture halved() const;
+};
+
+//This class will handle loading all necessary texture images. Images the texture pack doesn't have are decoded in parallel on a worker pool.
+//Given a memory budget it streams instead: nothing loads up front, a texture loads in the background the first frame something
+//samples it (the placeholder is drawn until then) and the least recently used ones are dropped once over budget
 class TextureHandler
 {
 private:
-    std::vector<std::vector<Uint32>> memPixels; //we need to load the texture RGB into memory since calculating the RGB value every fkn time kills frame rate (reduce regular function calls)
-    std::pair<int, int>* textureSizes;
-    int numTextures;
-    std::vector<std::vector<unsigned char>> loadedTextures;
-    std::vector<std::pair<int, int>> loadedTextureSizes; //width height pairs
+    std::vector<std::vector<Texture>> textures; //mip chain per texture, full size first down to 1x1. Empty while streamed out
+    std::vector<std::string> names;
+    std::unique_ptr<TexturePack> pack; //cached textures view into its mapping
+    int decoded = 0;
+    static const int LOADING_REFRESH_MS = 33; //loading screen redraw interval while images decode
+    //streaming state, all of it only changes in update() between frames
+    std::vector<Texture> placeholder;
+    const size_t budgetBytes = 0; //0 keeps everything resident
+    size_t residentBytes = 0;
+    Uint32 frame = 1;
+    std::unique_ptr<std::atomic<Uint32>[]> lastUse; //frame each texture was last sampled in, written by the render workers
+    std::vector<char> loading;
+    std::vector<int> batch; //textures the loader is decoding
+    std::vector<std::vector<Texture>> batchResults;
+    std::vector<char> batchFailed;
+    std::unique_ptr<WorkerPool> loader;
+    int loads = 0;
+    int evictions = 0;
+    void install(int i, std::vector<Texture> chain);
+    void evict(int i);
 public:
-    TextureHandler(SDL_Renderer* renderer, std::vector<std::string>);
-    int numOfTextures() { return loadedTextures.size(); };
-    inline std::vector<unsigned char> textureAt(int i) { return loadedTextures[i]; };
-    inline std::pair<int, int> widthHeightAt(int i) { return loadedTextureSizes[i]; };
-    inline rgba colorAt(int textureIndex, int x, int y);
-    inline std::vector<std::vector<unsigned char>>& getLoadedTextures() {return loadedTextures;};
+    //packPath names a texture pack to load decoded textures from, it gets rebuilt when any image is missing or changed.
+    //A non zero budgetBytes streams textures instead of loading them here, the pack is only read from then
+    TextureHandler(SDL_Renderer* renderer, std::vector<std::string>, const std::string& packPath = "", size_t budgetBytes = 0);
+    ~TextureHandler();
+    //images that went through the decoder instead of coming from the pack
+    int getDecodedCount() const { return decoded; };
+    //Streaming, call once between frames from the main thread. Takes in what the loader finished, starts loading what
+    //last frame sampled and evicts least recently used textures that weren't sampled last frame until under budget
+    void update();
+    //fixed at construction, streaming state only exists for a handler built with a budget
+    size_t getBudget() const { return budgetBytes; };
+    size_t getResidentBytes() const { return residentBytes; };
+    bool isResident(int i) const { return !textures[i].empty(); };
+    bool isLoading() const { return !batch.empty(); };
+    int getLoads() const { return loads; };
+    int getEvictions() const { return evictions; };
+    //mip chain to sample, the placeholder until a streamed texture is in. Marks the texture used this frame
+    const std::vector<Texture>& chain(int i) const
+    {
+        if (budgetBytes && lastUse[i].load(std::memory_order_relaxed) != frame) lastUse[i].store(frame, std::memory_order_relaxed);
+        return textures[i].empty() ? placeholder : textures[i];
+    };
+    int numOfTextures() const { return textures.size(); };
+    const Texture& textureAt(int i) const { return chain(i)[0]; };
+    int mipCount(int i) const { return chain(i).size(); };
+    const Texture& mipAt(int i, int level) const { const std::vector<Texture>& c = chain(i); return c[nva::clamp<int>(level, 0, c.size() - 1)]; };
+    //level that puts about one texel on each screen pixel when the full size texture covers texelsPerPixel per pixel
+    const Texture& mipFor(int i, double texelsPerPixel) const { return (texelsPerPixel < 2) ? textureAt(i) : mipAt(i, static_cast<int>(log2(texelsPerPixel))); };
+    inline std::pair<int, int> widthHeightAt(int i) const { const Texture& t = textureAt(i); return std::make_pair(t.width, t.height); };
+    //texel packed as RGBA8888
+    Uint32 pixelAt(int textureIndex, int x, int y) const { return textureAt(textureIndex).at(x, y); };
 };
 
 //Game Class to clean things up a bit and provide a template
@@ -197,7 +438,7 @@ protected:
     SDL_PixelFormat* format = SDL_AllocFormat(SDL_PIXELFORMAT_RGBA8888);
     SDL_Renderer* renderer = nullptr;
     SDL_Window* window = nullptr;
-    FOX_Font *font;
+    FOX_Font *font = nullptr;
     const int SCREEN_WIDTH;
     const int SCREEN_HEIGHT;
     double oldTime = 0;
@@ -216,50 +457,154 @@ y+
 |
 ˇ
 */
+//One grid cell, everything the raycaster, floor caster, collision and pathfinding need in 16 bytes so
+//a lookup is a single cache line instead of a walk through five nested vectors
+enum CellFlags { CELL_SOLID = 1, CELL_DOOR = 2, CELL_SKY = 4, CELL_UNLOADED = 8 };
+struct alignas(16) Cell
+{
+    Sint32 wall = 0; //wall texture id, 0 is open
+    Uint16 floor = 0;
+    Uint16 ceiling = 0; //ignored when CELL_SKY is set
+    Sint16 door = -1; //index into the map's doors, -1 if none
+    Uint8 light = 255; //lightmap value scaled to 0-255
+    Uint8 flags = 0;
+};
+
+//Cells live in fixed size chunks behind a flat table of chunk pointers. Maps built in memory keep every chunk,
+//maps opened from a chunk file page them in around the player and the rays (streamAround) and evict distant
+//ones to stay under a memory budget. Cells of paged out chunks read as solid walls (wall 1, CELL_UNLOADED set)
+
+struct MapChunk
+{
+    std::unique_ptr<Cell[]> cells;
+    bool dirty = false; //edited since it was read, gets written back before eviction
+};
+
 class Map
 {
 public:
-    Map(std::vector<std::vector<int>> m, std::vector<Sprite> s = {}) : map(m) {}
+    Map(const std::vector<std::vector<int>>& m, std::vector<Sprite> s = {});
+    //empty map that streams its cells from a file written by saveChunkFile, check isStreaming afterwards
+    Map(const std::string& chunkFile, size_t residentBudgetBytes);
+    //map that uses an opened level file's cells in place, the level's mapping moves into the map
+    Map(LevelFile& level);
+    Map(const Map&) = delete;
+    Map& operator=(const Map&) = delete;
+    ~Map();
     void addSprite(Sprite *s) { sprites.push_back(s); };
     Sprite& getSpriteAt(int i) { return *sprites[i];};
     void removeSpriteAtEnd() { sprites.pop_back(); };
     void removeSpriteAt(int i) { sprites.erase(sprites.begin() + i); };
-    int getTileAt(int x, int y) { return map[y][x]; };
-    int ySize() { return map[0].size(); };
-    int xSize() { return map.size(); };
+    //x is the column and y the row like everywhere else. Two shifts, a mask and one pointer, no virtual calls
+    const Cell& cellAt(int x, int y) const
+    {
+        const Cell* chunk = chunkTable[(y >> nva::CHUNK_SHIFT) * chunksX + (x >> nva::CHUNK_SHIFT)];
+        if (!chunk)
+        {
+            requestChunk(x, y);
+            return unloadedCell;
+        }
+        return chunk[((y & (nva::CHUNK_SIZE - 1)) << nva::CHUNK_SHIFT) | (x & (nva::CHUNK_SIZE - 1))];
+    };
+    //cellAt without asking for paged out chunks, so the searches can look ahead without driving streaming
+    const Cell& peekCellAt(int x, int y) const
+    {
+        const Cell* chunk = chunkTable[(y >> nva::CHUNK_SHIFT) * chunksX + (x >> nva::CHUNK_SHIFT)];
+        return chunk ? chunk[((y & (nva::CHUNK_SIZE - 1)) << nva::CHUNK_SHIFT) | (x & (nva::CHUNK_SIZE - 1))] : unloadedCell;
+    };
+    bool inBounds(int x, int y) const { return x >= 0 && y >= 0 && x < width && y < height; };
+    int getTileAt(int x, int y) const { return cellAt(x, y).wall; };
+    void setTileAt(int x, int y, int wall);
+    //Chebyshev distance from an in bounds cell to the nearest wall, door, paged out cell or the map edge, capped at
+    //SKIP_MAX. Every cell closer than that is open, so a ray can cross that square without looking at any of it
+    int skipAt(int x, int y) const { return skipField[y * width + x]; };
+    //goes up whenever walls change or chunks page in or out, so anything caching walkability can tell it's stale.
+    //Doors don't count, walkability ignores door state
+    Uint64 getLayoutRevision() const { return layoutRevision; };
+    //one byte per cell, 1 where the searches may walk: resident and no wall. Door cells have no wall so they're
+    //walkable whatever state the door is in, same as isValid always did. Kept in step with the layout revision
+    const std::vector<Uint8>& getWalkField() const { return walkField; };
+    bool isWalkable(int x, int y) const { return walkField[y * width + x]; };
+    int xSize() const { return width; };
+    int ySize() const { return height; };
     std::vector<Sprite*> getSprites() { return sprites; };
-    void setFloorMap(std::vector<std::vector<int>> m) { floorMap = m; };
-    int getFloorTileAt(int x, int y) { return floorMap[y][x]; };
-    void setCeilingMap(std::vector<std::vector<int>> m) { ceilingMap = m; };
-    int getCeilingTileAt(int x, int y) { return ceilingMap[y][x]; };
-    void setDoorMap(std::vector<std::vector<Door>> m) { doorMap = m; };
-    Door getDoorTileAt(int x, int y) { return doorMap[y][x]; };
-    void setDoorStateAt(int x, int y, Door d) { doorMap[y][x] = d; };
-    void setLightMap(std::vector<std::vector<double>> d) { lightMap = d; };
-    double getLightTileAt(int x, int y) { return lightMap[y][x]; };
-    void setLightStateAt(int x, int y, double d) { lightMap[y][x] = d; };
+    void setFloorMap(const std::vector<std::vector<int>>& m);
+    int getFloorTileAt(int x, int y) const { return cellAt(x, y).floor; };
+    void setCeilingMap(const std::vector<std::vector<int>>& m);
+    int getCeilingTileAt(int x, int y) const { return (cellAt(x, y).flags & CELL_SKY) ? SKY : cellAt(x, y).ceiling; };
+    //neither adds doors to a streaming map, the chunk file's door table can't grow under the chunks written back to it
+    void setDoorMap(const std::vector<std::vector<Door>>& m);
+    const Door& doorAt(int index) const { return doors[index]; };
+    //cells without a door hand back a door that doesn't exist
+    const Door& getDoorTileAt(int x, int y) const { return (cellAt(x, y).door >= 0) ? doors[cellAt(x, y).door] : noDoor; };
+    void setDoorStateAt(int x, int y, Door d);
+    void setLightMap(const std::vector<std::vector<double>>& d);
+    double getLightTileAt(int x, int y) const { return cellAt(x, y).light / 255.0; };
+    void setLightStateAt(int x, int y, double d) { mutableCellAt(x, y).light = static_cast<Uint8>(round(nva::clamp<double>(d, 0, 1) * 255)); };
     void setSkyTexture(int i) { skyTexture = i; };
-    int getSkyTexture() {return skyTexture; };
+    int getSkyTexture() const {return skyTexture; };
     EntityHandler* getEntities() { return entitiesOnMap; };
     void setEntityHandler(EntityHandler* p) { entitiesOnMap = p; };
-    Door getDoorByID(int ID);
+    //doors sharing an ID are linked, these read the first of them and write all of them
+    Door getDoorByID(int ID) const;
     void setDoorByID(int ID, Door d);
+    //indexes into the door table of every door with this ID
+    const std::vector<int>& getDoorIndexes(int ID) const;
+    const std::vector<Door>& getDoors() const { return doors; };
     void updateDoors(double t);
     void toggleDoorByID(int ID);
     //checks if a given point is within one unit of the door (for locally opening doors)
     bool isDoorNeighbor(Point p);
+    //writes the map (cells, doors and sky) out as a chunk file other maps can stream from
+    bool saveChunkFile(const std::string& path) const;
+    bool isStreaming() const { return pageFile != nullptr; };
+    int chunkCount() const { return chunksX * chunksY; };
+    //copies a chunk's cells out whether it's resident or not
+    bool copyChunk(int index, Cell* dst) const;
+    //Pages in chunks within radius chunks of p plus the ones rays ran into since the last call, evicting the
+    //farthest chunks once over budget. Main thread only, between frames, never while the render pool is casting
+    void streamAround(Point p, int radius = nva::STREAM_RADIUS);
+    int getResidentChunks() const { return residentChunks.size(); };
+    Uint64 getChunkLoads() const { return chunkLoads; };
 private:
-    //Could eventually swap int for a Tile class
-    int skyTexture;
-    std::vector<std::vector<int>> map;
-    std::vector<std::vector<int>> floorMap;
-    std::vector<std::vector<int>> ceilingMap;
-    std::vector<std::vector<Door>> doorMap;
-    //lightmap values may need to be prebaked to improve performance (division x amount of times per frame adds up)
-    std::vector<std::vector<double>> lightMap;
+    int skyTexture = 0;
+    int width = 0;
+    int height = 0;
+    int chunksX = 0;
+    int chunksY = 0;
+    std::vector<Cell*> chunkTable; //what cellAt reads, null while a chunk is paged out
+    std::vector<MapChunk> chunks;
+    std::vector<int> residentChunks;
+    std::unique_ptr<std::atomic<bool>[]> chunkWanted; //set by rays hitting paged out chunks, read by streamAround
+    FILE* pageFile = nullptr;
+    std::unique_ptr<MappedFile> mappedLevel;
+    long long chunkDataOffset = 0;
+    size_t budgetChunks = 0;
+    Uint64 chunkLoads = 0;
+    //a dark wall in the pack's first texture, so rays, shots, sight and movement all stop at paged out chunks
+    //the same way they stop at walls until streamAround brings them in
+    inline static const Cell unloadedCell = {1, 0, 0, -1, 0, CELL_SOLID | CELL_UNLOADED};
+    std::vector<Uint8> skipField;
+    std::vector<Uint8> walkField;
+    Uint64 layoutRevision = 0;
+    //recomputes the skip field for everything a change to cells in [x0, x1] x [y0, y1] can reach
+    void updateSkipField(int x0, int y0, int x1, int y1);
+    //recomputes the walk field over [x0, x1] x [y0, y1]
+    void updateWalkField(int x0, int y0, int x1, int y1);
+    void allocateChunks();
+    void requestChunk(int x, int y) const;
+    bool loadChunk(int index);
+    void evictChunk(int index);
+    bool readChunk(int index, Cell* dst) const;
+    //editing goes through here so paged out chunks get loaded first and marked for write back
+    Cell& mutableCellAt(int x, int y);
+    std::vector<Door> doors;
+    Door noDoor;
+    std::unordered_map<int, std::vector<int>> doorIndexesByID;
+    std::vector<int> activeDoors; //IDs of doors mid animation
+    void indexDoors();
     std::vector<Sprite*> sprites;
     EntityHandler* entitiesOnMap = nullptr;
-    std::unordered_set<int> doorsInProgress;
 };
 
 //Little object to tidy up raycast return
@@ -273,6 +618,46 @@ struct CollisionEvent
     double doorProgress; //door data
 };
 
+//One line of sight check between two points in map units
+struct SightQuery
+{
+    Point from;
+    Point to;
+};
+
+struct SightResult
+{
+    bool visible = false;
+    double distance = 0; //how far along the segment the first wall or door is, the segment length when nothing is
+};
+
+//CPU framebuffer the raycaster draws into, RGBA8888. pitch is in bytes same as SDL_LockTexture hands back
+struct RenderTarget
+{
+    Uint32* pixels = nullptr;
+    int width = 0;
+    int height = 0;
+    int pitch = 0;
+};
+
+//Cached camera projection keyed on FOV and render size. Holds each column's rotation away from the view
+//direction so a ray is just the view vector rotated by a precomputed cos/sin, which is also the fish eye correction
+struct CameraProjection
+{
+    int FOV = -1; //half FOV in degrees like the renderer uses
+    int width = 0;
+    int height = 0;
+    double adj = 0; //distance to the projection plane in columns
+    double planeStep = 0; //camera plane distance between the two centre columns, for picking floor mip levels
+    std::vector<double> cosOffset;
+    std::vector<double> sinOffset;
+    std::vector<double> tanOffset; //where the column crosses the camera plane, for floor casting
+    std::vector<double> rowDistance; //floor distance of each screen row below the horizon
+    bool matches(int fov, int w, int h) const { return fov == FOV && w == width && h == height; };
+    void build(int fov, int w, int h);
+    bool screenXForAngle(double relativeAngle, double& screenX) const;
+};
+
 //Specific type of game that contains a 2d map and various functions to build a game from such a 2d map
 class GridGame : public Game
 {
@@ -287,8 +672,44 @@ private:
     TextureHandler* currentTextureSet = nullptr;
     SDL_Texture* textureBuffer = nullptr;
     const double SKYSCALEFACTOR = 2;
+    std::unique_ptr<WorkerPool> renderPool; //created once, reused every frame
+    std::vector<RenderScratch> renderScratch; //one per render worker
+    std::vector<Uint64> columnCost; //ticks each column took last frame, used to balance the next one
+    std::vector<int> chunkStarts; //column chunk boundaries handed to the render pool
+    std::vector<double> zBuffer; //perpendicular wall distance per column for sprite occlusion
+    CameraProjection projection;
+    std::vector<int> floorStart; //first screen row of floor under each column
+    bool headless = false;
+    RenderTarget headlessTarget;
+    bool hudEnabled = true;
+    const int GUNSCALE = 4;
+    RenderStats stats; //frame being rendered
+    RenderStats lastStats; //last finished frame
+    bool statsOverlay = false;
+    HudText hud;
+    int healthLine;
+    std::vector<int> statsLines; //created the first time the stats overlay is shown
+    Uint64 lastStatsRefresh = 0;
+    const double STATS_REFRESH_MS = 250; //the overlay is for reading, redrawing it every frame just makes it flicker
+    ShadeTable shading;
+    bool mipmapping = true;
+    bool emptySpaceSkipping = true;
+    bool packetRays = true;
+    std::unordered_map<int, SDL_Texture*> overlayCache; //HUD and viewmodel images already uploaded, keyed by texture index
+    void balanceColumns(int columns);
+    void updateStatsOverlay();
+    void renderScene(const RenderTarget& target, int FOV, double wallheight);
+    void presentFrame();
+    void compositeHud(const RenderTarget& target);
 public:
-    GridGame(int w, int h, SDL_Window* win, SDL_Renderer* r) : Game(w, h, win, r) {}
+    GridGame(int w, int h, SDL_Window* win, SDL_Renderer* r) : Game(w, h, win, r), renderPool(new WorkerPool())
+    {
+        renderScratch.resize(renderPool->size());
+        healthLine = hud.addLine({0, 0});
+        setHealth(100);
+    }
+    //Headless game with no window or renderer, call setHeadlessTarget before rendering
+    GridGame(int w, int h) : GridGame(w, h, nullptr, nullptr) {}
     //sets the current map pointer
     void setMap(Map* m) { map = m; };
     //returns the current map pointer
@@ -301,28 +722,77 @@ public:
     void drawRect(SDL_Rect, rgba);
     //Performs a raycast from start point at angle on current map
     //Returns CollisionEvent
-    inline CollisionEvent ddaRaycast(Point start, double angle);
+    //cellSteps (optional) is bumped for every grid cell the ray visits
+    inline CollisionEvent ddaRaycast(Point start, double angle, Uint64* cellSteps = nullptr) const;
+    //Same thing with a unit direction and the fish eye correction already worked out
+    inline CollisionEvent ddaRaycast(Point start, Point rayDir, double fishEye, Uint64* cellSteps = nullptr) const;
+    //Casts RAY_PACKET rays from the same start at once, hits come back in the same order as the directions
+    void ddaRaycastPacket(Point start, const Point* rayDirs, const double* fishEye, CollisionEvent* hits, Uint64* cellSteps = nullptr) const;
     //Renders false 3d untextured
     void pseudo3dRender(int FOV, double wallheight=1);
     //Renders false 3d textured
     void pseudo3dRenderTextured(int FOV, double wallheight=1);
     void setPlayerPos(Point p);
-    Point getPlayerPos() { return playerPos; };
+    //moves the player without collision checks (scripted cameras)
+    void teleportPlayer(Point p) { playerPos = p; };
+    Point getPlayerPos() const { return playerPos; };
     int getCellWidth() { return SCREEN_WIDTH / map->xSize(); };
     int getCellHeight() { return SCREEN_HEIGHT / map->ySize(); };
     void setMoveSpeed(double s) { moveSpeed = s; };
     void setRotSpeed(double s) { rotSpeed = s; };
     double getMoveSpeed() { return moveSpeed; };
     double getRotSpeed() { return rotSpeed; };
-    double getAngle() { return angle; };
+    double getAngle() const { return angle; };
     void setAngle(double a) { angle = fmod(a, 360); }; //clamps angle to 0,360 degrees
-    void setTextureSet(TextureHandler* t){ currentTextureSet = t; };
+    //swapping texture sets drops the overlay cache since its indexes belong to the old set
+    void setTextureSet(TextureHandler* t);
     double getMouseSens() { return mouseSens; };
     void setMouseSens(double d) { mouseSens = d; };
     //The index of the image of the gun currently being rendered
     void setGunIndex(int i) { gunIndex = i; };
     int getGunIndex() { return gunIndex; };
+    //GPU copy of a texture for drawing HUD art with SDL_RenderCopy, uploaded on first use and kept until the texture set changes.
+    //nullptr while a streamed texture is still loading
+    SDL_Texture* getOverlayTexture(int i);
+    void clearOverlayCache();
+    //ID of the first entity a shot at angle a (degrees) hits before a wall or door, -1 for none
     int shoot(Point p, double a);
+    //Same for a unit direction and reach. Walks the ray's cells and only tests the entities filed in them.
+    //distance (optional) gets how far along the ray the entity was hit
+    int hitscan(Point start, Point dir, double range, double* distance = nullptr) const;
+    //Checks every from -> to segment against walls and doors, spread across the render pool. Independent of the
+    //camera, call it from the game thread outside of rendering. results ends up the same size as queries
+    void lineOfSight(const std::vector<SightQuery>& queries, std::vector<SightResult>& results) const;
+    //Renders into a caller owned framebuffer instead of the window (for profiling and tests without a display)
+    void setHeadlessTarget(Uint32* pixels, int w, int h, int pitch) { headlessTarget = {pixels, w, h, pitch}; headless = true; };
+    void clearHeadlessTarget() { headless = false; };
+    bool isHeadless() const { return headless; };
+    int getRenderWidth() const { return headless ? headlessTarget.width : INTERNAL_RENDER_RES_HORIZ; };
+    int getRenderHeight() const { return headless ? headlessTarget.height : INTERNAL_RENDER_RES_VERT; };
+    //Toggles drawing the gun and HUD text on top of the scene
+    void setHudEnabled(bool b) { hudEnabled = b; };
+    bool getHudEnabled() const { return hudEnabled; };
+    //Per stage timings and counters of the last rendered frame
+    const RenderStats& getRenderStats() const { return lastStats; };
+    //HUD text layer drawn over the scene, add lines to it for ammo, score and so on
+    HudText& getHud() { return hud; };
+    void setHealth(int hp) { hud.setValue(healthLine, "Health: ", hp); };
+    //Draws the render stats over the frame using the game font
+    void setStatsOverlay(bool b) { statsOverlay = b; };
+    bool getStatsOverlay() const { return statsOverlay; };
+    //Distance fog density per map unit (0 is off)
+    void setFog(double density) { shading.setFog(density); };
+    double getFog() const { return shading.getFog(); };
+    const ShadeTable& getShadeTable() const { return shading; };
+    //Samples walls, floors and sprites from smaller mip levels with distance
+    void setMipmapping(bool b) { mipmapping = b; };
+    bool getMipmapping() const { return mipmapping; };
+    //rays cross open areas a skip field square at a time instead of cell by cell, same hits either way
+    void setEmptySpaceSkipping(bool b) { emptySpaceSkipping = b; };
+    bool getEmptySpaceSkipping() const { return emptySpaceSkipping; };
+    //the wall pass casts columns RAY_PACKET at a time in lockstep, same hits as one at a time
+    void setPacketRays(bool b) { packetRays = b; };
+    bool getPacketRays() const { return packetRays; };
     ~GridGame();
 };
 
@@ -23,13 +23,14 @@ https://creativecommons.org/licenses/by-sa/4.0/
 
 #include "engine.hpp"
 #include "Pathfinding.hpp"
+#include "Benchmark.hpp"
+#include "LevelFile.hpp"
 /*          TODO LIST
     *ui
     *timer factory
     *Pathfinding (A*)
         -AI
     *menu
-    *loading and storing into binary
     *re org code better (sprites and entites the same)
         -Maybe static sprite entity factory? gameobject or something
 */
@@ -42,6 +43,7 @@ GridGame* game;
 SDL_Renderer* renderer = nullptr;
 SDL_Window* window = nullptr;
 Pathfinder *pf = new Pathfinder();
+FlowField *chase = new FlowField(); //directions to the player for everything chasing them
 Map* myMap = new Map({{1, 1, 1, 1, 1, 1, 1, 1},
                       {1, 0, 0, 0, 1, 0, 0, 1},
                       {1, 0, 0, 0, 1, 0, 0, 1},
@@ -92,6 +94,16 @@ EntityHandler *mapEntities = new EntityHandler();
 EntityController *entCon = new EntityController(myMap, mapEntities);
 
 const int FOV = 105; 
+
+//camera path for --benchmark, loops through the open cells of myMap
+std::vector<CameraKeyframe> benchmarkPath = {{{1.5, 1.5}, 0},
+                                             {{3.5, 1.5}, 90},
+                                             {{3.5, 4.5}, 0},
+                                             {{6.5, 4.5}, 270},
+                                             {{6.5, 1.5}, 180},
+                                             {{5.5, 4.5}, 180},
+                                             {{1.5, 4.5}, 270},
+                                             {{1.5, 1.5}, 0}};
  
 double ticktime;
 SDL_TimerID timerID;
@@ -148,20 +160,11 @@ void handleInput()
         try
         {
             Point location = entCon->getPosByID(0);
-            Node start = { { (int)location.x, (int)location.y } };
-            Node end = { {(int)game->getPlayerPos().x, (int)game->getPlayerPos().y} };
-            auto test = pf->aStar(start, end);
-            std::vector<Node> path;
-            for (Node node : test) {
-                //std::cout << node.pos.x << " " << node.pos.y << std::endl;
-                path.push_back(node);
-            }
-            if (path.empty()) return;
+            Point nextCell = chase->nextStep(location.x, location.y);
+            if (nextCell.x < 0) return; //already there, can't get there or the field isn't built yet
             else
             {
-                if (path.size() < 2) return;
-                Node nextNode = path.at(1);
-                Point endp = {((int)nextNode.pos.x) + 0.5, ((int)nextNode.pos.y) + 0.5};
+                Point endp = {((int)nextCell.x) + 0.5, ((int)nextCell.y) + 0.5};
                 double angle = Pathfinder::calcAngle(location, endp) * (M_PI / 180.0);
                 double xcom, ycom;
                 double speed = 1;
@@ -182,6 +185,7 @@ void playLoop()
     handleInput();
     ticktime = game->frameTime();
     game->getCurMap()->updateDoors(ticktime);
+    chase->update(game->getPlayerPos());
     totalTime += ticktime;
     game->pseudo3dRenderTextured(FOV);
 }
@@ -189,7 +193,10 @@ void playLoop()
 void eventHandler(SDL_Event event)
 {
     if (event.type == SDL_KEYDOWN) keyhandler->keyDown(event.key.keysym.sym);
+    if (event.type == SDL_KEYDOWN && event.key.keysym.sym == SDLK_F3 && !event.key.repeat)
+        game->setStatsOverlay(!game->getStatsOverlay());
     if (event.type == SDL_KEYUP) keyhandler->keyUp(event.key.keysym.sym);
+    if (event.type == SDL_RENDER_TARGETS_RESET) game->getHud().invalidate(); //the HUD layer's contents are gone
     if (event.type == SDL_MOUSEMOTION)
     {
         game->setAngle(game->getAngle() + event.motion.xrel * game->getMouseSens());
@@ -198,6 +205,47 @@ void eventHandler(SDL_Event event)
 
 int main(int argc, char** argv)
 { 
+    //--headless renders into a plain framebuffer without opening a window
+    //--benchmark [frames] flies the camera along benchmarkPath and prints frame time stats as JSON
+    //--level <file> plays a binary level instead of the built in map, --save-level <file> writes the built in map out as one
+    //--texture-budget <MB> streams textures in as they're seen and keeps them under that much memory
+    //--path-benchmark [queries] times aStar against jps on a large open map and prints the stats as JSON
+    bool headless = false;
+    int benchmarkFrames = 0;
+    int pathQueries = 0;
+    size_t textureBudget = 0;
+    std::string levelPath, saveLevelPath;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "--headless") headless = true;
+        else if (arg == "--benchmark")
+        {
+            benchmarkFrames = 600;
+            if (i + 1 < argc && isdigit(argv[i + 1][0])) benchmarkFrames = std::stoi(argv[++i]);
+        }
+        else if (arg == "--path-benchmark")
+        {
+            pathQueries = 200;
+            if (i + 1 < argc && isdigit(argv[i + 1][0])) pathQueries = std::stoi(argv[++i]);
+        }
+        else if (arg == "--level" && i + 1 < argc) levelPath = argv[++i];
+        else if (arg == "--save-level" && i + 1 < argc) saveLevelPath = argv[++i];
+        else if (arg == "--texture-budget" && i + 1 < argc) textureBudget = static_cast<size_t>(std::stoul(argv[++i])) << 20;
+    }
+    if (pathQueries > 0)
+    {
+        SDL_Init(SDL_INIT_TIMER);
+        Map openMap(PathBenchmark::openMap(512));
+        std::cout << PathBenchmark(&openMap).run(pathQueries).toJSON() << std::endl;
+        SDL_Quit();
+        return 0;
+    }
+    if (headless && benchmarkFrames == 0)
+    {
+        std::cout << "--headless needs --benchmark, there is nothing to show\n";
+        return 1;
+    }
     // Sprite animSides = {2, 2, 0, 0, true, {}, true, {}, {
     //     {64, 0, 64, 1},
     //     {64, 3, 64, 2},
@@ -226,25 +274,87 @@ int main(int argc, char** argv)
     myMap->setDoorMap(doorMap);
     myMap->setLightMap(lightMap);
     myMap->setSkyTexture(3);
-    SDL_Init(SDL_INIT_VIDEO | SDL_INIT_TIMER);
-    TTF_Init();
-    FOX_Init();
-    window = SDL_CreateWindow("3D!! Raycaster", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, SCREEN_WIDTH, SCREEN_HEIGHT, SDL_WINDOW_SHOWN);
-    // Create SDL renderer with target texture flag
-    renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_TARGETTEXTURE | SDL_RENDERER_PRESENTVSYNC | SDL_RENDERER_ACCELERATED);
-    SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "0"); // for resolution scaling
-    game = new GridGame(SCREEN_WIDTH, SCREEN_HEIGHT, window, renderer);
-    TextureHandler *myTexture = new TextureHandler(renderer, {"wood.jpg", "floor.jpg", "wooddoor.jpg", "globe.png", "bri.jpg", "wolf3d-guard_01.gif", "wolf3d-guard_02.gif", "wolf3d-guard_03.gif", "wolf3d-guard_04.gif", "wolf3d-guard_05.gif", "wolf3d-guard_06.png", "wolf3d-guard_07.gif", "wolf3d-guard_08.gif", "wolf-shoot_01.png", "wolf-shoot_02.png", "wolf-shoot_03.png", "texlibdoor.gif", "DESuperShotgun_f02.png", "DESuperShotgun_f03.png"});
+    if (!saveLevelPath.empty())
+    {
+        bool saved = LevelFile::write(saveLevelPath, *myMap, myMap->getSprites(), mapEntities);
+        std::cout << (saved ? "Saved level to " : "Couldn't save level to ") << saveLevelPath << "\n";
+        return saved ? 0 : 1;
+    }
+    static std::vector<Sprite> levelSprites;
+    static std::vector<EntitySpawn> levelSpawns;
+    //levels are checked against this list before anything reads their texture ids
+    const std::vector<std::string> textureNames = {"wood.jpg", "floor.jpg", "wooddoor.jpg", "globe.png", "bri.jpg", "wolf3d-guard_01.gif", "wolf3d-guard_02.gif", "wolf3d-guard_03.gif", "wolf3d-guard_04.gif", "wolf3d-guard_05.gif", "wolf3d-guard_06.png", "wolf3d-guard_07.gif", "wolf3d-guard_08.gif", "wolf-shoot_01.png", "wolf-shoot_02.png", "wolf-shoot_03.png", "texlibdoor.gif", "DESuperShotgun_f02.png", "DESuperShotgun_f03.png"};
+    if (!levelPath.empty())
+    {
+        LevelFile level;
+        if (!level.open(levelPath, textureNames.size())) return 1;
+        levelSprites = level.sprites();
+        levelSpawns = level.spawns();
+        myMap = new Map(level);
+        mapEntities = new EntityHandler();
+        myMap->setEntityHandler(mapEntities);
+        entCon = new EntityController(myMap, mapEntities);
+        //EntityController pairs entity i with sprite i, so the paired spawns go in first and the loose ones after
+        std::vector<bool> paired(levelSprites.size(), false);
+        for (EntitySpawn& spawn : levelSpawns)
+        {
+            if (spawn.sprite < 0) continue;
+            entCon->createEntityAndSpriteAt(&spawn.entity, &levelSprites[spawn.sprite], spawn.entity.pos, spawn.entity.radius, spawn.entity.nametype);
+            paired[spawn.sprite] = true;
+        }
+        for (size_t i = 0; i < levelSprites.size(); i++)
+            if (!paired[i]) myMap->addSprite(&levelSprites[i]);
+        for (EntitySpawn& spawn : levelSpawns)
+            if (spawn.sprite < 0) mapEntities->addEntity(&spawn.entity);
+    }
+    std::vector<Uint32> framebuffer;
+    if (headless)
+    {
+        SDL_Init(SDL_INIT_TIMER);
+        game = new GridGame(SCREEN_WIDTH, SCREEN_HEIGHT);
+        framebuffer.resize(INTERNAL_RENDER_RES_HORIZ * INTERNAL_RENDER_RES_VERT);
+        game->setHeadlessTarget(framebuffer.data(), INTERNAL_RENDER_RES_HORIZ, INTERNAL_RENDER_RES_VERT, INTERNAL_RENDER_RES_HORIZ * sizeof(Uint32));
+    }
+    else
+    {
+        SDL_Init(SDL_INIT_VIDEO | SDL_INIT_TIMER);
+        TTF_Init();
+        FOX_Init();
+        window = SDL_CreateWindow("3D!! Raycaster", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, SCREEN_WIDTH, SCREEN_HEIGHT, SDL_WINDOW_SHOWN);
+        // Create SDL renderer with target texture flag. No vsync when benchmarking, the frame timer would just measure the refresh rate
+        Uint32 rendererFlags = SDL_RENDERER_TARGETTEXTURE | SDL_RENDERER_ACCELERATED;
+        if (benchmarkFrames == 0) rendererFlags |= SDL_RENDERER_PRESENTVSYNC;
+        renderer = SDL_CreateRenderer(window, -1, rendererFlags);
+        SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "0"); // for resolution scaling
+        game = new GridGame(SCREEN_WIDTH, SCREEN_HEIGHT, window, renderer);
+    }
+    TextureHandler *myTexture = new TextureHandler(renderer, textureNames, "textures.nvtp", textureBudget);
     game->setTextureSet(myTexture);
     game->setAngle(0);
     game->setMap(myMap);
     game->setPlayerPos({1.5,1.5});
     game->setEventHandler(eventHandler);
-    SDL_SetRelativeMouseMode(SDL_TRUE);
-    //SDL_SetWindowFullscreen(window, SDL_WINDOW_FULLSCREEN_DESKTOP);
-    game->setFont(FOX_OpenFont(renderer, "./fonts/SuboleyaRegular.ttf", 25));
     game->setGunIndex(17);
     pf->setMap(myMap);
+    chase->setMap(myMap);
+    if (!headless) game->setFont(FOX_OpenFont(renderer, "./fonts/SuboleyaRegular.ttf", 25));
+    if (benchmarkFrames > 0)
+    {
+        Benchmark bench(game);
+        bench.setPath(benchmarkPath);
+        std::cout << bench.run(benchmarkFrames, FOV).toJSON() << std::endl;
+        if (!headless)
+        {
+            FOX_CloseFont(game->getFont());
+            FOX_Exit();
+            TTF_Quit();
+        }
+        delete game;
+        SDL_Quit();
+        return 0;
+    }
+    SDL_SetRelativeMouseMode(SDL_TRUE);
+    //SDL_SetWindowFullscreen(window, SDL_WINDOW_FULLSCREEN_DESKTOP);
     game->gameplayLoop(playLoop);	
     TTF_Quit();
     FOX_CloseFont(game->getFont());